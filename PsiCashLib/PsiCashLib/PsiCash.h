@@ -29,6 +29,7 @@
 #import "Purchase.h"
 #import "PurchasePrice.h"
 
+@class PsiCashMakePurchaseResultModel;
 
 typedef NS_ENUM(NSInteger, PsiCashStatus) {
     PsiCashStatus_Invalid = -1,
@@ -84,6 +85,20 @@ typedef NS_ENUM(NSInteger, PsiCashStatus) {
     expired (even if the local clock hasn't yet indicated it).
     Can be passed an NSArray literal, like: @code @[id1, id2] @endcode */
 - (void)removePurchases:(NSArray<NSString*>*_Nonnull)ids;
+/*! Sets a retention policy for expired purchases, which are otherwise kept
+    until expirePurchases or removePurchases: is called. Once set, expired
+    purchases are evicted from storage when the policy is set and when new
+    purchases are stored:
+    • those that have been expired for longer than gracePeriod seconds;
+    • the earliest-expired, when more than maxExpired expired purchases remain.
+    The purchases accessors don't write storage, but they leave out purchases
+    that are due for eviction.
+    Evicted purchases will not be returned by expirePurchases, so an app that
+    relies on it to learn of expiries should use a gracePeriod longer than the
+    interval between its calls. Use DBL_MAX and NSUIntegerMax (the defaults) for
+    no limit. The policy is not persisted. */
+- (void)setExpiredPurchaseRetentionGracePeriod:(NSTimeInterval)gracePeriod
+                           maxExpiredPurchases:(NSUInteger)maxExpired;
 
 /*! Utilizes stored tokens to craft a landing page URL.
     Returns an error if modification is impossible. (In that case the error
@@ -92,6 +107,14 @@ typedef NS_ENUM(NSInteger, PsiCashStatus) {
 - (NSError*_Nullable)modifyLandingPage:(NSString*_Nonnull)url
                            modifiedURL:(NSString*_Nullable*_Nonnull)modifiedURL;
 
+/*! Like modifyLandingPage:modifiedURL:, but for multiple URLs at once (such as
+    all of the home pages for a connection). The PsiCash data is only built once.
+    modifiedURLs will have the same count and order as urls. Any URL that can't be
+    modified is included unchanged, and an error is returned. (As above, the error
+    should be logged and home page opening should proceed.) */
+- (NSError*_Nullable)modifyLandingPages:(NSArray<NSString*>*_Nonnull)urls
+                           modifiedURLs:(NSArray<NSString*>*_Nullable*_Nonnull)modifiedURLs;
+
 /*! Creates a data package that should be included with a webhook for a user
     action that should be rewarded (such as watching a rewarded video).
     NOTE: The resulting string will still need to be encoded for use in a URL.
@@ -212,6 +235,78 @@ Completion handler parameters:
                                                                  PsiCashPurchase*_Nullable purchase,
                                                                  NSError*_Nullable error))completion;
 
+/*!
+ Like newExpiringPurchaseTransactionForClass:withDistinguisher:withExpectedPrice:withCompletion:,
+ but first checks the purchase against the locally stored state. If the stored
+ state shows that the transaction would certainly fail, the failure status is
+ returned without making a server request.
+
+ Input parameters:
+
+ • transactionClass, transactionDistinguisher, expectedPrice: As above.
+
+ • maxLocalStateAge: The maximum age, in seconds, of the stored balance and
+   purchase prices for them to be used for the local check. The age is measured
+   from the last time both were received from the server during this session.
+   If the stored state is older than this (or was never received this session),
+   the request goes straight to the server.
+
+ Completion handler parameters:
+
+ • status, purchase, error: As above.
+
+ • locallyDetermined: YES if the status was determined from local state and no
+   request was made. NO if the status comes from the server and is authoritative.
+
+ If the stored purchase prices don't include the transaction class at all, it
+ may simply not have been requested in refreshState, so none of the checks below
+ are made and the server is asked.
+
+ Possible locally determined status codes:
+
+ • PsiCashStatus_TransactionTypeNotFound: The stored purchase prices include the
+   transaction class but not the distinguisher.
+
+ • PsiCashStatus_TransactionAmountMismatch: The stored price does not match expectedPrice.
+
+ • PsiCashStatus_ExistingTransaction: There is a valid (non-expired) purchase of
+   the same class.
+
+ • PsiCashStatus_InsufficientBalance: The stored balance is less than expectedPrice.
+ */
+- (void)newExpiringPurchaseTransactionForClass:(NSString*_Nonnull)transactionClass
+                             withDistinguisher:(NSString*_Nonnull)transactionDistinguisher
+                             withExpectedPrice:(NSNumber*_Nonnull)expectedPrice
+                          withMaxLocalStateAge:(NSTimeInterval)maxLocalStateAge
+                                withCompletion:(void (^_Nonnull)(PsiCashStatus status,
+                                                                 PsiCashPurchase*_Nullable purchase,
+                                                                 BOOL locallyDetermined,
+                                                                 NSError*_Nullable error))completion;
+
+/*!
+ Makes several "expiring-purchase" transactions at once, such as a speed-boost
+ plus a purchase of another class. The requests are made one at a time, in the
+ order of items, reusing a single connection. So earlier items have priority:
+ if there isn't enough balance for all of them, or two are of the same class,
+ the earlier one succeeds. The stored purchases and balance are updated once,
+ after all of the requests have completed.
+
+ Input parameters:
+
+ • items: The purchases to make. For each, transactionClass, distinguisher, and
+   price (the expected price) are used as for
+   newExpiringPurchaseTransactionForClass:withDistinguisher:withExpectedPrice:withCompletion:.
+   Items are independent: the failure of one doesn't prevent the others.
+
+ Completion handler parameters:
+
+ • results: One result per item, in the same order as items. Each has the status,
+   purchase, and error that newExpiringPurchaseTransactionForClass:... would have
+   provided for that item alone. (inProgress will be NO.)
+ */
+- (void)newExpiringPurchaseTransactions:(NSArray<PsiCashPurchasePrice*>*_Nonnull)items
+                         withCompletion:(void (^_Nonnull)(NSArray<PsiCashMakePurchaseResultModel*>*_Nonnull results))completion;
+
 @end
 
 #endif /* PsiCash_h */
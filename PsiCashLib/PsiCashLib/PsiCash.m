@@ -29,6 +29,8 @@
 #import "PurchasePrice.h"
 #import "Utils.h"
 #import "RequestBuilder.h"
+#import "ServerTimeEstimator.h"
+#import "PsiCashAPIModels.h"
 
 /* TODO
  - Consider using NSUbiquitousKeyValueStore instead of NSUserDefaults for
@@ -64,13 +66,27 @@ NSUInteger const REQUEST_RETRY_LIMIT = 2;
 NSString * const LANDING_PAGE_PARAM_KEY = @"psicash";
 NSString * const EARNER_TOKEN_TYPE = @"earner";
 long long const MAX_INITIAL_BALANCE = 100000000000LL;
+NSUInteger const SERVER_TIME_SAMPLE_WINDOW = 8;
+NSTimeInterval const SERVER_TIME_DIFF_MIN_CHANGE_SECS = 0.5;
 
 @implementation PsiCash {
     NSString *serverScheme;
     NSString *serverHostname;
     NSNumber *serverPort;
     UserInfo *userInfo;
+    ServerTimeEstimator *serverTimeEstimator;
     dispatch_queue_t completionQueue;
+
+    // Cached landing page and rewarded activity data. Synchronized on self.
+    NSUInteger psiCashDataVersion;
+    NSString *landingPageFragmentData;
+    NSString *landingPageQueryData;
+    NSString *rewardedActivityData;
+    NSError *rewardedActivityDataError;
+
+    // Expired purchase retention policy. Synchronized on self.
+    NSTimeInterval expiredPurchaseGracePeriod;
+    NSUInteger maxExpiredPurchases;
 }
 
 # pragma mark - Init
@@ -85,7 +101,13 @@ long long const MAX_INITIAL_BALANCE = 100000000000LL;
 
     // authTokens may still be nil if the value has never been stored.
     self->userInfo = [[UserInfo alloc] init];
-    
+
+    self->serverTimeEstimator = [[ServerTimeEstimator alloc] initWithWindowSize:SERVER_TIME_SAMPLE_WINDOW];
+
+    // Expired purchases are kept until expirePurchases is called, unless a retention policy is set.
+    self->expiredPurchaseGracePeriod = DBL_MAX;
+    self->maxExpiredPurchases = NSUIntegerMax;
+
     [self initRequestMetadata];
 
     return self;
@@ -138,65 +160,95 @@ long long const MAX_INITIAL_BALANCE = 100000000000LL;
     }
 }
 
-/*! Helper for removing and returning expired purchases. Calls populatePurchasesLocalTimeExpiry. */
-- (NSArray<PsiCashPurchase*>*_Nullable)findExpiredPurchases:(NSArray<PsiCashPurchase*>*_Nullable)purchases
+- (void)setExpiredPurchaseRetentionGracePeriod:(NSTimeInterval)gracePeriod
+                           maxExpiredPurchases:(NSUInteger)maxExpired
 {
-    if (!purchases) {
-        return nil;
+    @synchronized(self)
+    {
+        self->expiredPurchaseGracePeriod = MAX(gracePeriod, 0.0);
+        self->maxExpiredPurchases = maxExpired;
     }
 
-    [self populatePurchasesLocalTimeExpiry:purchases];
-
-    NSMutableArray<PsiCashPurchase*> *expiredPurchases = [[NSMutableArray alloc] init];
-    NSDate *now = [NSDate date];
+    [self applyPurchaseRetention];
+}
 
-    for (PsiCashPurchase *purchase in purchases) {
-        if ([purchase.localTimeExpiry compare:now] == NSOrderedAscending) {
-            [expiredPurchases addObject:purchase];
-        }
+/*! Helper. Returns NO if there is no retention policy. Otherwise sets gracePeriod
+    and maxExpired to the policy values. */
+- (BOOL)purchaseRetentionGracePeriod:(NSTimeInterval*_Nonnull)gracePeriod
+                          maxExpired:(NSUInteger*_Nonnull)maxExpired
+{
+    @synchronized(self)
+    {
+        *gracePeriod = self->expiredPurchaseGracePeriod;
+        *maxExpired = self->maxExpiredPurchases;
     }
 
-    if (expiredPurchases.count == 0) {
-        return nil;
+    return !(*gracePeriod == DBL_MAX && *maxExpired == NSUIntegerMax);
+}
+
+/*! Helper. Evicts expired purchases according to the retention policy. This
+    writes the stored purchases, so it's only called when they're being written
+    anyway (or when the policy is set), not from the accessors. */
+- (void)applyPurchaseRetention
+{
+    NSTimeInterval gracePeriod;
+    NSUInteger maxExpired;
+    if (![self purchaseRetentionGracePeriod:&gracePeriod maxExpired:&maxExpired]) {
+        return;
     }
 
-    return expiredPurchases;
+    [self->userInfo removeExpiredPurchasesAt:[self adjustLocalTimeToServer:[NSDate date]]
+                                 gracePeriod:gracePeriod
+                                  maxExpired:maxExpired];
 }
 
 - (NSArray<PsiCashPurchase*>*_Nullable)purchases
 {
-    NSArray<PsiCashPurchase*>* purchases = self->userInfo.purchases;
+    NSArray<PsiCashPurchase*>* purchases;
+
+    NSTimeInterval gracePeriod;
+    NSUInteger maxExpired;
+    if ([self purchaseRetentionGracePeriod:&gracePeriod maxExpired:&maxExpired]) {
+        // Leave out the purchases that are due for eviction, without evicting them.
+        purchases = [self->userInfo purchasesRetainedAt:[self adjustLocalTimeToServer:[NSDate date]]
+                                            gracePeriod:gracePeriod
+                                             maxExpired:maxExpired];
+    }
+    else {
+        purchases = self->userInfo.purchases;
+    }
+
     [self populatePurchasesLocalTimeExpiry:purchases];
     return purchases;
 }
 
 - (NSArray<PsiCashPurchase*>*_Nullable)validPurchases
 {
-    NSArray<PsiCashPurchase*> *purchases = [self purchases];
-    NSArray<PsiCashPurchase*> *expiredPurchases = [self findExpiredPurchases:purchases];
-    NSArray<PsiCashPurchase*> *validPurchases = [self removePurchases:expiredPurchases from:purchases];
+    // Only the valid purchases are materialized. (The retention policy only
+    // affects expired purchases.)
+    NSArray<PsiCashPurchase*> *validPurchases = [self->userInfo purchasesValidAt:[self adjustLocalTimeToServer:[NSDate date]]];
+    [self populatePurchasesLocalTimeExpiry:validPurchases];
     return validPurchases;
 }
 
 - (PsiCashPurchase*_Nullable)nextExpiringPurchase
 {
-    // This populates localTimeExpiry
-    NSArray<PsiCashPurchase*> *purchases = [self purchases];
-
     PsiCashPurchase *next;
-    for (PsiCashPurchase *purchase in purchases) {
-        if (purchase.serverTimeExpiry == nil) {
-            continue;
-        }
 
-        if (next == nil) {
-            next = purchase;
-            continue;
-        }
+    NSTimeInterval gracePeriod;
+    NSUInteger maxExpired;
+    if ([self purchaseRetentionGracePeriod:&gracePeriod maxExpired:&maxExpired]) {
+        // Leave out the purchases that are due for eviction, without evicting them.
+        next = [self->userInfo nextExpiringPurchaseRetainedAt:[self adjustLocalTimeToServer:[NSDate date]]
+                                                  gracePeriod:gracePeriod
+                                                   maxExpired:maxExpired];
+    }
+    else {
+        next = [self->userInfo nextExpiringPurchase];
+    }
 
-        if ([purchase.serverTimeExpiry compare:next.serverTimeExpiry] == NSOrderedAscending) {
-            next = purchase;
-        }
+    if (next) {
+        [self populatePurchasesLocalTimeExpiry:@[next]];
     }
 
     return next; // may be nil
@@ -204,154 +256,186 @@ long long const MAX_INITIAL_BALANCE = 100000000000LL;
 
 - (NSArray<PsiCashPurchase*>*_Nullable)expirePurchases
 {
-    // This populates localTimeExpiry
-    NSArray<PsiCashPurchase*> *purchases = [self purchases];
-
-    if (!purchases) {
+    NSArray<PsiCashPurchase*> *expiredPurchases = [self->userInfo removeExpiredPurchasesAt:[self adjustLocalTimeToServer:[NSDate date]]
+                                                                               gracePeriod:0.0
+                                                                                maxExpired:0];
+    if (expiredPurchases.count == 0) {
         return nil;
     }
 
-    NSArray<PsiCashPurchase*> *expiredPurchases = [self findExpiredPurchases:purchases];
-    NSArray<PsiCashPurchase*> *prunedPurchases = [self removePurchases:expiredPurchases
-                                                                  from:purchases];
-
-    [self->userInfo setPurchases:prunedPurchases];
-
+    [self populatePurchasesLocalTimeExpiry:expiredPurchases];
     return expiredPurchases;
 }
 
 - (void)removePurchases:(NSArray<NSString*>*_Nonnull)ids
 {
-    NSArray<PsiCashPurchase*> *purchases = [self purchases];
-    NSArray<PsiCashPurchase*>* pruned = [self removePurchaseIDs:ids
-                                                           from:purchases];
-    [self->userInfo setPurchases:pruned];
+    [self->userInfo removePurchasesWithIDs:ids];
 }
 
-/*! Helper */
-- (NSArray<PsiCashPurchase*>*_Nullable)removePurchaseIDs:(NSArray<NSString*>*_Nonnull)ids
-                                                    from:(NSArray<PsiCashPurchase*>*_Nullable)purchases
+- (NSError*_Nullable)modifyLandingPage:(NSString*_Nonnull)url
+                           modifiedURL:(NSString*_Nullable*_Nonnull)modifiedURL
 {
-    if ([ids count] == 0) {
-        return purchases;
-    }
+    *modifiedURL = nil;
 
-    if ([purchases count] == 0) {
-        return nil;
+    // We only need to know that the URL can be decomposed; the modification
+    // itself is done by splicing strings.
+    if (![NSURLComponents componentsWithString:url]) {
+        // Decomposing the URL failed. We can't possibly modify it.
+        return [NSError errorWithMessage:@"NSURLComponents::componentsWithString failed to decompose URL"
+                            fromFunction:__FUNCTION__];
     }
 
-    NSMutableIndexSet *indexesToRemove = [[NSMutableIndexSet alloc] init];
-
-    for (NSString *purchaseID in ids) {
-        for (int i = 0; i < [purchases count]; i++) {
-            PsiCashPurchase *purchase = purchases[i];
-            if ([purchase.ID isEqualToString:purchaseID]) {
-                [indexesToRemove addIndex:i];
-                break;
-            }
-        }
-    }
+    NSString *fragmentData, *queryData;
+    [self landingPageFragmentData:&fragmentData queryData:&queryData];
 
-    NSMutableArray<PsiCashPurchase*> *prunedPurchases = [purchases mutableCopy];
-    [prunedPurchases removeObjectsAtIndexes:indexesToRemove];
+    *modifiedURL = [PsiCash spliceLandingPageData:url
+                                     fragmentData:fragmentData
+                                        queryData:queryData];
 
-    return prunedPurchases;
+    return nil;
 }
 
-/*! Helper */
-- (NSArray<PsiCashPurchase*>*_Nullable)removePurchases:(NSArray<PsiCashPurchase*>*_Nonnull)purchasesToRemove
-                                                  from:(NSArray<PsiCashPurchase*>*_Nullable)purchases
+- (NSError*_Nullable)modifyLandingPages:(NSArray<NSString*>*_Nonnull)urls
+                           modifiedURLs:(NSArray<NSString*>*_Nullable*_Nonnull)modifiedURLs
 {
-    if (!purchases) {
-        return nil;
+    *modifiedURLs = nil;
+
+    // The data is the same for every URL, so only get it once.
+    NSString *fragmentData, *queryData;
+    [self landingPageFragmentData:&fragmentData queryData:&queryData];
+
+    NSMutableArray<NSString*> *results = [NSMutableArray arrayWithCapacity:urls.count];
+    NSUInteger failures = 0;
+
+    for (NSString *url in urls) {
+        if (![NSURLComponents componentsWithString:url]) {
+            // Can't modify this one, but the home page should still be opened.
+            [results addObject:url];
+            failures += 1;
+            continue;
+        }
+
+        [results addObject:[PsiCash spliceLandingPageData:url
+                                             fragmentData:fragmentData
+                                                queryData:queryData]];
     }
 
-    NSMutableArray<NSString*> *idsToRemove = [NSMutableArray arrayWithCapacity:purchasesToRemove.count];
+    *modifiedURLs = results;
 
-    for (PsiCashPurchase *purchaseToRemove in purchasesToRemove) {
-        [idsToRemove addObject:purchaseToRemove.ID];
+    if (failures > 0) {
+        return [NSError errorWithMessage:[NSString stringWithFormat:@"NSURLComponents::componentsWithString failed to decompose %lu URL(s)", (unsigned long)failures]
+                            fromFunction:__FUNCTION__];
     }
 
-    return [self removePurchaseIDs:idsToRemove from:purchases];
+    return nil;
 }
 
-- (NSError*_Nullable)modifyLandingPage:(NSString*_Nonnull)url
-                           modifiedURL:(NSString*_Nullable*_Nonnull)modifiedURL
+/*! Helper. Adds the already-encoded landing page data to url. */
++ (NSString*_Nonnull)spliceLandingPageData:(NSString*_Nonnull)url
+                              fragmentData:(NSString*_Nonnull)fragmentData
+                                 queryData:(NSString*_Nonnull)queryData
 {
-    *modifiedURL = nil;
+    // Our preference is to put the token into the URL's fragment/hash/anchor,
+    // because we'd prefer the token not to be sent to the server.
+    // But if there already is a value there we'll put it into the query parameters.
+    // (Because altering the fragment is more likely to have negative consequences
+    // for the page than adding a query parameter that will be ignored.)
 
-    NSURLComponents *urlComponents = [NSURLComponents componentsWithString:url];
-    if (!urlComponents) {
-        // Decomposing the URL failed. We can't possibly modify it.
-        return [NSError errorWithMessage:@"NSURLComponents::componentsWithString failed to decompose URL"
-                            fromFunction:__FUNCTION__];
-    }
+    NSRange fragmentStart = [url rangeOfString:@"#"];
 
-    NSMutableDictionary<NSString*,NSObject*> *psiCashData = [[NSMutableDictionary alloc] init];
-    psiCashData[@"v"] = @2;
+    if (fragmentStart.location == NSNotFound) {
+        return [NSString stringWithFormat:@"%@#%@=%@", url, LANDING_PAGE_PARAM_KEY, fragmentData];
+    }
 
-    if (!self->userInfo.authTokens ||
-        ![self->userInfo.authTokens[EARNER_TOKEN_TYPE] isKindOfClass:[NSString class]]) {
-        psiCashData[@"tokens"] = NSNull.null;
+    // The URL already has a fragment; use a query param. The result is the
+    // same as adding an NSURLQueryItem via NSURLComponents.
+    NSString *beforeFragment = [url substringToIndex:fragmentStart.location];
+    NSString *separator = @"&";
+    NSRange queryStart = [beforeFragment rangeOfString:@"?"];
+    if (queryStart.location == NSNotFound) {
+        separator = @"?";
     }
-    else {
-        psiCashData[@"tokens"] = self->userInfo.authTokens[EARNER_TOKEN_TYPE];
+    else if (NSMaxRange(queryStart) == beforeFragment.length) {
+        // There's a '?' but an empty query.
+        separator = @"";
     }
 
-    // Get the metadata (sponsor ID, etc.)
-    psiCashData[@"metadata"] = self->userInfo.requestMetadata;
+    return [NSString stringWithFormat:@"%@%@%@=%@%@",
+            beforeFragment,
+            separator,
+            LANDING_PAGE_PARAM_KEY,
+            queryData,
+            [url substringFromIndex:fragmentStart.location]];
+}
 
-    NSJSONWritingOptions jsonOpts = 0;
-    if (@available(iOS 11.0, *)) {
-        // We're going to sort the keys if possible to make testing easier
-        // (expected results can be sane).
-        jsonOpts = NSJSONWritingSortedKeys;
-    }
+- (NSError*_Nullable)getRewardedActivityData:(NSString*_Nullable*_Nonnull)dataString
+{
+    *dataString = nil;
 
     NSError *error;
-    NSData *dataJSON = [NSJSONSerialization dataWithJSONObject:psiCashData
-                                                       options:jsonOpts
-                                                         error:&error];
-    NSString *dataString = @"{}";
-    if (!error) {
-        dataString = [[NSString alloc] initWithData:dataJSON
-                                           encoding:NSUTF8StringEncoding];
+
+    @synchronized(self)
+    {
+        [self updatePsiCashDataCache];
+        *dataString = self->rewardedActivityData;
+        error = self->rewardedActivityDataError;
     }
 
-    // Our preference is to put the token into the URL's fragment/hash/anchor,
-    // because we'd prefer the token not to be sent to the server.
-    // But if there already is a value there we'll put it into the query parameters.
-    // (Because altering the fragment is more likely to have negative consequences
-    // for the page than adding a query parameter that will be ignored.)
+    return error;
+}
 
-    if (urlComponents.fragment) {
-        // The URL already has a fragment; use a query param.
-        NSMutableArray<NSURLQueryItem*> *queryItems = [NSMutableArray arrayWithArray:urlComponents.queryItems];
-        [queryItems addObject:[NSURLQueryItem queryItemWithName:LANDING_PAGE_PARAM_KEY
-                                                          value:dataString]];
-        urlComponents.queryItems = queryItems;
-        *modifiedURL = [NSString stringWithString:urlComponents.string];
+/*! Helper. Gets the encoded landing page data, rebuilding it if necessary. */
+- (void)landingPageFragmentData:(NSString*_Nonnull*_Nonnull)fragmentData
+                      queryData:(NSString*_Nonnull*_Nonnull)queryData
+{
+    @synchronized(self)
+    {
+        [self updatePsiCashDataCache];
+        *fragmentData = self->landingPageFragmentData;
+        *queryData = self->landingPageQueryData;
     }
-    else {
-        // We can't use urlComponents.fragment, because we'll end up
-        // double-encoding our payload.
+}
 
-        // Make the URL without the fragment.
-        *modifiedURL = [NSString stringWithString:urlComponents.string];
+/*! Helper. Rebuilds the landing page and rewarded activity data if the auth tokens
+    or request metadata have changed since they were last built. Must be called
+    while synchronized on self. */
+- (void)updatePsiCashDataCache
+{
+    // The version must be read before the values it covers. If they change in
+    // between, the cache will be rebuilt again on the next call.
+    NSUInteger version = self->userInfo.tokensAndMetadataVersion;
+    if (self->landingPageFragmentData && version == self->psiCashDataVersion) {
+        return;
+    }
 
-        // Append the fragment.
-        NSString *fragment = [NSString stringWithFormat:@"#%@=%@",
-                              LANDING_PAGE_PARAM_KEY,
-                              [Utils encodeURIComponent:dataString]];
-        *modifiedURL = [*modifiedURL stringByAppendingString:fragment];
+    NSString *earnerToken;
+    NSDictionary<NSString*, NSString*> *authTokens = self->userInfo.authTokens;
+    if ([authTokens[EARNER_TOKEN_TYPE] isKindOfClass:[NSString class]]) {
+        earnerToken = authTokens[EARNER_TOKEN_TYPE];
     }
 
-    return nil;
-}
+    // Get the metadata (sponsor ID, etc.)
+    NSDictionary<NSString*,id> *metadata = self->userInfo.requestMetadata;
 
-- (NSError*_Nullable)getRewardedActivityData:(NSString*_Nullable*_Nonnull)dataString
-{
-    *dataString = nil;
+    // Landing page data
+
+    NSError *error;
+    NSData *dataJSON = [PsiCash psiCashDataJSON:@2
+                                    earnerToken:earnerToken
+                                       metadata:metadata
+                                          error:&error];
+    NSString *landingPageData = @"{}";
+    if (!error) {
+        landingPageData = [[NSString alloc] initWithData:dataJSON
+                                                encoding:NSUTF8StringEncoding];
+    }
+
+    // For the fragment we can't let NSURLComponents do the encoding, because
+    // we'll end up double-encoding our payload.
+    self->landingPageFragmentData = [Utils encodeURIComponent:landingPageData];
+    self->landingPageQueryData = [Utils encodeQueryValue:landingPageData];
+
+    // Rewarded activity data
 
     /*
      The data is base64-encoded JSON-serialized with this structure:
@@ -369,21 +453,43 @@ long long const MAX_INITIAL_BALANCE = 100000000000LL;
      }
     */
 
-    NSMutableDictionary<NSString*,NSObject*> *psiCashData = [[NSMutableDictionary alloc] init];
-    psiCashData[@"v"] = @1;
+    self->rewardedActivityData = nil;
+    self->rewardedActivityDataError = nil;
 
-    // Get the earner token. If we don't have one, the webhook can't succeed.
-    if (!self->userInfo.authTokens ||
-        ![self->userInfo.authTokens[EARNER_TOKEN_TYPE] isKindOfClass:[NSString class]]) {
-        return [NSError errorWithMessage:@"earner token missing; can't create webhoook data"
-                            fromFunction:__FUNCTION__];
+    if (!earnerToken) {
+        // If we don't have an earner token, the webhook can't succeed.
+        self->rewardedActivityDataError = [NSError errorWithMessage:@"earner token missing; can't create webhoook data"
+                                                       fromFunction:__FUNCTION__];
     }
     else {
-        psiCashData[@"tokens"] = self->userInfo.authTokens[EARNER_TOKEN_TYPE];
+        error = nil;
+        dataJSON = [PsiCash psiCashDataJSON:@1
+                                earnerToken:earnerToken
+                                   metadata:metadata
+                                      error:&error];
+        if (error) {
+            self->rewardedActivityDataError = [NSError errorWrapping:error
+                                                         withMessage:@"JSON serialization failed"
+                                                        fromFunction:__FUNCTION__];
+        }
+        else {
+            self->rewardedActivityData = [dataJSON base64EncodedStringWithOptions:0];
+        }
     }
 
-    // Get the metadata (sponsor ID, etc.)
-    psiCashData[@"metadata"] = self->userInfo.requestMetadata;
+    self->psiCashDataVersion = version;
+}
+
+/*! Helper. JSON-serializes the data package shared by landing pages and rewarded activities. */
++ (NSData*_Nullable)psiCashDataJSON:(NSNumber*_Nonnull)v
+                        earnerToken:(NSString*_Nullable)earnerToken
+                           metadata:(NSDictionary<NSString*,id>*_Nullable)metadata
+                              error:(NSError*_Nullable*_Nonnull)error
+{
+    NSMutableDictionary<NSString*,NSObject*> *psiCashData = [[NSMutableDictionary alloc] init];
+    psiCashData[@"v"] = v;
+    psiCashData[@"tokens"] = earnerToken ? earnerToken : NSNull.null;
+    psiCashData[@"metadata"] = metadata;
 
     NSJSONWritingOptions jsonOpts = 0;
     if (@available(iOS 11.0, *)) {
@@ -392,20 +498,9 @@ long long const MAX_INITIAL_BALANCE = 100000000000LL;
         jsonOpts = NSJSONWritingSortedKeys;
     }
 
-    NSError *error;
-    NSData *dataJSON = [NSJSONSerialization dataWithJSONObject:psiCashData
-                                                       options:jsonOpts
-                                                         error:&error];
-
-    if (error) {
-        return [NSError errorWrapping:error
-                          withMessage:@"JSON serialization failed"
-                         fromFunction:__FUNCTION__];
-    }
-
-    *dataString = [dataJSON base64EncodedStringWithOptions:0];
-
-    return nil;
+    return [NSJSONSerialization dataWithJSONObject:psiCashData
+                                           options:jsonOpts
+                                             error:error];
 }
 
 -(NSDictionary<NSString*, NSObject*>*_Nonnull)getDiagnosticInfo
@@ -419,6 +514,15 @@ long long const MAX_INITIAL_BALANCE = 100000000000LL;
              forKey:@"balance"];
     [info setObject:[NSNumber numberWithDouble:self->userInfo.serverTimeDiff] forKey:@"serverTimeDiff"];
 
+    NSTimeInterval estimatedServerTimeDiff, serverTimeDiffUncertainty;
+    if ([self->serverTimeEstimator serverTimeDiff:&estimatedServerTimeDiff
+                                      uncertainty:&serverTimeDiffUncertainty]) {
+        [info setObject:[NSNumber numberWithDouble:serverTimeDiffUncertainty] forKey:@"serverTimeDiffUncertainty"];
+    }
+    else {
+        [info setObject:NSNull.null forKey:@"serverTimeDiffUncertainty"];
+    }
+
     NSMutableArray<NSDictionary*> *purchasePricesDicts = [[NSMutableArray alloc] init];
     if (self.purchasePrices) {
         for (PsiCashPurchasePrice *pp in self.purchasePrices) {
@@ -428,8 +532,9 @@ long long const MAX_INITIAL_BALANCE = 100000000000LL;
     [info setObject:purchasePricesDicts forKey:@"purchasePrices"];
 
     NSMutableArray<NSDictionary*> *purchasesDicts = [[NSMutableArray alloc] init];
-    if (self.purchases) {
-        for (PsiCashPurchase *p in self.purchases) {
+    NSArray<PsiCashPurchase*> *purchases = self.purchases;
+    if (purchases) {
+        for (PsiCashPurchase *p in purchases) {
             [purchasesDicts addObject:[p toDictionary]];
         }
     }
@@ -871,131 +976,330 @@ long long const MAX_INITIAL_BALANCE = 100000000000LL;
                                                                  PsiCashPurchase*_Nullable purchase,
                                                                  NSError*_Nullable error))completionHandler
 {
-    NSMutableArray *queryItems = [[NSMutableArray alloc] init];
-    [queryItems addObject:[NSURLQueryItem queryItemWithName:@"class"
-                                                      value:transactionClass]];
-    [queryItems addObject:[NSURLQueryItem queryItemWithName:@"distinguisher"
-                                                      value:transactionDistinguisher]];
-
-    // Note the conversion from positive to negative: price to amount.
-    [queryItems addObject:[NSURLQueryItem queryItemWithName:@"expectedAmount"
-                                                      value:[NSString stringWithFormat:@"-%lld", expectedPrice.longLongValue]]];
-
-    RequestBuilder *requestBuilder = [self createRequestBuilderFor:@"/transaction"
-                                                        withMethod:@"POST"
-                                                    withQueryItems:queryItems
-                                                 includeAuthTokens:YES];
+    RequestBuilder *requestBuilder = [self createNewTransactionRequestBuilderForClass:transactionClass
+                                                                    withDistinguisher:transactionDistinguisher
+                                                                    withExpectedPrice:expectedPrice];
 
     [self doRequestWithRetry:requestBuilder
                     useCache:NO
            completionHandler:^(NSData *data, NSHTTPURLResponse *response, NSError *error)
      {
-         if (error) {
-             error = [NSError errorWrapping:error withMessage:@"request error" fromFunction:__FUNCTION__];
-             dispatch_async(self->completionQueue, ^{
-                 completionHandler(PsiCashStatus_Invalid, nil, error);
-             });
-             return;
+         PsiCashPurchase *purchase;
+         NSNumber *balance;
+         NSError *resultError;
+         PsiCashStatus status = [self processNewTransactionResponse:response
+                                                               data:data
+                                                       requestError:error
+                                                   transactionClass:transactionClass
+                                                  withDistinguisher:transactionDistinguisher
+                                                           purchase:&purchase
+                                                            balance:&balance
+                                                              error:&resultError];
+
+         if (balance) {
+             self->userInfo.balance = balance;
          }
 
-         NSDate *serverTimeExpiry;
-         NSString *transactionID, *authorization;
+         if (purchase) {
+             [self->userInfo addPurchase:purchase];
+             [self applyPurchaseRetention];
+         }
 
-         if (response.statusCode == kHTTPStatusOK ||
-             response.statusCode == kHTTPStatusTooManyRequests ||
-             response.statusCode == kHTTPStatusPaymentRequired ||
-             response.statusCode == kHTTPStatusConflict) {
-             if (!data || data.length == 0) {
-                 error = [NSError errorWithMessage:@"request returned no data" fromFunction:__FUNCTION__];
-                 dispatch_async(self->completionQueue, ^{
-                     completionHandler(PsiCashStatus_Invalid, nil, error);
-                 });
-                 return;
-             }
+         dispatch_async(self->completionQueue, ^{
+             completionHandler(status, purchase, resultError);
+         });
+     }];
+}
 
-             NSNumber *transactionAmount, *balance;
+- (void)newExpiringPurchaseTransactions:(NSArray<PsiCashPurchasePrice*>*_Nonnull)items
+                         withCompletion:(void (^_Nonnull)(NSArray<PsiCashMakePurchaseResultModel*>*_Nonnull results))completionHandler
+{
+    // The requests are made one at a time, in item order, so that earlier items
+    // have priority (for the balance, and over other purchases of the same class).
+    // They share a session, so the connection is set up once and then reused.
+    NSURLSession *session = [NSURLSession sessionWithConfiguration:[PsiCash sessionConfiguration:NO]];
+
+    NSMutableArray<PsiCashMakePurchaseResultModel*> *results = [NSMutableArray arrayWithCapacity:items.count];
+
+    [self newExpiringPurchaseTransactions:items
+                                fromIndex:0
+                                  session:session
+                                  results:results
+                                  balance:nil
+                           withCompletion:^(NSNumber *finalBalance)
+     {
+         [session finishTasksAndInvalidate];
 
-             [PsiCash parseNewTransactionResponse:data
-                                transactionAmount:&transactionAmount
-                                          balance:&balance
-                                           expiry:&serverTimeExpiry
-                                    transactionID:&transactionID
-                                    authorization:&authorization
-                                        withError:&error];
-             if (error != nil) {
-                 error = [NSError errorWrapping:error withMessage:@"" fromFunction:__FUNCTION__];
-                 dispatch_async(self->completionQueue, ^{
-                     completionHandler(PsiCashStatus_Invalid, nil, error);
-                 });
-                 return;
+         NSMutableArray<PsiCashPurchase*> *purchases = [NSMutableArray arrayWithCapacity:results.count];
+         for (PsiCashMakePurchaseResultModel *result in results) {
+             if (result.purchase) {
+                 [purchases addObject:result.purchase];
              }
+         }
 
-             if (balance) {
-                 self->userInfo.balance = balance;
-             }
+         // A single update of the stored state for the whole batch.
+         if (purchases.count > 0 || finalBalance) {
+             [self->userInfo addPurchases:purchases withBalance:finalBalance];
+             [self applyPurchaseRetention];
          }
 
-         if (response.statusCode == kHTTPStatusOK) {
-             PsiCashPurchase *purchase = [[PsiCashPurchase alloc] initWithID:transactionID
-                                                            transactionClass:transactionClass
-                                                               distinguisher:transactionDistinguisher
-                                                            serverTimeExpiry:serverTimeExpiry
-                                                             localTimeExpiry:[self adjustServerTimeToLocal:serverTimeExpiry]
-                                                               authorization:authorization];
-             [self->userInfo addPurchase:purchase];
+         // Already on the completionQueue.
+         completionHandler(results);
+     }];
+}
 
-             dispatch_async(self->completionQueue, ^{
-                 completionHandler(PsiCashStatus_Success, purchase, nil);
-             });
-             return;
-         }
-         else if (response.statusCode == kHTTPStatusTooManyRequests) {
-             dispatch_async(self->completionQueue, ^{
-                 completionHandler(PsiCashStatus_ExistingTransaction, nil, nil);
-             });
-             return;
-         }
-         else if (response.statusCode == kHTTPStatusPaymentRequired) {
-             dispatch_async(self->completionQueue, ^{
-                 completionHandler(PsiCashStatus_InsufficientBalance, nil, nil);
-             });
-             return;
-         }
-         else if (response.statusCode == kHTTPStatusConflict) {
-             dispatch_async(self->completionQueue, ^{
-                 completionHandler(PsiCashStatus_TransactionAmountMismatch, nil, nil);
-             });
-             return;
-         }
-         else if (response.statusCode == kHTTPStatusNotFound) {
-             dispatch_async(self->completionQueue, ^{
-                 completionHandler(PsiCashStatus_TransactionTypeNotFound, nil, nil);
-             });
-             return;
-         }
-         else if (response.statusCode == kHTTPStatusUnauthorized) {
-             dispatch_async(self->completionQueue, ^{
-                 completionHandler(PsiCashStatus_InvalidTokens, nil, nil);
-             });
-             return;
-         }
-         else if (response.statusCode == kHTTPStatusInternalServerError) {
-             dispatch_async(self->completionQueue, ^{
-                 completionHandler(PsiCashStatus_ServerError, nil, nil);
-             });
-             return;
+/*! Makes the transaction request for items[index], adds its result to results,
+    and then continues with the next item. After the last item, completionHandler
+    is called on the completionQueue with the most recently reported balance. */
+- (void)newExpiringPurchaseTransactions:(NSArray<PsiCashPurchasePrice*>*_Nonnull)items
+                              fromIndex:(NSUInteger)index
+                                session:(NSURLSession*_Nonnull)session
+                                results:(NSMutableArray<PsiCashMakePurchaseResultModel*>*_Nonnull)results
+                                balance:(NSNumber*_Nullable)balance
+                         withCompletion:(void (^_Nonnull)(NSNumber*_Nullable finalBalance))completionHandler
+{
+    if (index >= items.count) {
+        dispatch_async(self->completionQueue, ^{
+            completionHandler(balance);
+        });
+        return;
+    }
+
+    PsiCashPurchasePrice *item = items[index];
+
+    RequestBuilder *requestBuilder = [self createNewTransactionRequestBuilderForClass:item.transactionClass
+                                                                    withDistinguisher:item.distinguisher
+                                                                    withExpectedPrice:item.price];
+
+    [self doRequestWithRetry:requestBuilder
+                    useCache:NO
+                     session:session
+           completionHandler:^(NSData *data, NSHTTPURLResponse *response, NSError *error)
+     {
+         PsiCashPurchase *purchase;
+         NSNumber *newBalance;
+         NSError *resultError;
+         PsiCashStatus status = [self processNewTransactionResponse:response
+                                                               data:data
+                                                       requestError:error
+                                                   transactionClass:item.transactionClass
+                                                  withDistinguisher:item.distinguisher
+                                                           purchase:&purchase
+                                                            balance:&newBalance
+                                                              error:&resultError];
+
+         if (purchase) {
+             [results addObject:[PsiCashMakePurchaseResultModel successWithStatus:status
+                                                                      andPurchase:purchase
+                                                                         andError:nil]];
          }
          else {
-             error = [NSError errorWithMessage:[NSString stringWithFormat:@"request failure: %ld", response.statusCode]
-                                  fromFunction:__FUNCTION__];
-             dispatch_async(self->completionQueue, ^{
-                 completionHandler(PsiCashStatus_Invalid, nil, error);
-             });
-             return;
+             [results addObject:[PsiCashMakePurchaseResultModel failedWithStatus:status
+                                                                         andError:resultError]];
          }
+
+         [self newExpiringPurchaseTransactions:items
+                                     fromIndex:index+1
+                                       session:session
+                                       results:results
+                                       balance:newBalance ? newBalance : balance
+                                withCompletion:completionHandler];
      }];
 }
 
+- (void)newExpiringPurchaseTransactionForClass:(NSString*_Nonnull)transactionClass
+                             withDistinguisher:(NSString*_Nonnull)transactionDistinguisher
+                             withExpectedPrice:(NSNumber*_Nonnull)expectedPrice
+                          withMaxLocalStateAge:(NSTimeInterval)maxLocalStateAge
+                                withCompletion:(void (^_Nonnull)(PsiCashStatus status,
+                                                                 PsiCashPurchase*_Nullable purchase,
+                                                                 BOOL locallyDetermined,
+                                                                 NSError*_Nullable error))completionHandler
+{
+    PsiCashStatus localStatus = [self prevalidateExpiringPurchaseForClass:transactionClass
+                                                        withDistinguisher:transactionDistinguisher
+                                                        withExpectedPrice:expectedPrice
+                                                     withMaxLocalStateAge:maxLocalStateAge];
+    if (localStatus != PsiCashStatus_Success) {
+        dispatch_async(self->completionQueue, ^{
+            completionHandler(localStatus, nil, YES, nil);
+        });
+        return;
+    }
+
+    // The local state doesn't rule out the purchase (or is too stale to say), so ask the server.
+    [self newExpiringPurchaseTransactionForClass:transactionClass
+                               withDistinguisher:transactionDistinguisher
+                               withExpectedPrice:expectedPrice
+                                  withCompletion:^(PsiCashStatus status,
+                                                   PsiCashPurchase*_Nullable purchase,
+                                                   NSError*_Nullable error)
+     {
+         // Already on the completionQueue.
+         completionHandler(status, purchase, NO, error);
+     }];
+}
+
+/*! Helper. Checks the purchase against the stored state. Returns PsiCashStatus_Success
+    if the purchase might succeed (or the stored state is too old to check against),
+    otherwise returns the failure status the server would give. */
+- (PsiCashStatus)prevalidateExpiringPurchaseForClass:(NSString*_Nonnull)transactionClass
+                                   withDistinguisher:(NSString*_Nonnull)transactionDistinguisher
+                                   withExpectedPrice:(NSNumber*_Nonnull)expectedPrice
+                                withMaxLocalStateAge:(NSTimeInterval)maxLocalStateAge
+{
+    NSNumber *localStateTime = self->userInfo.localStateMonotonicTime;
+    if (!localStateTime || [Utils monotonicTime] - localStateTime.doubleValue > maxLocalStateAge) {
+        return PsiCashStatus_Success;
+    }
+
+    // If we have prices for the class, then we know all of its distinguishers.
+    BOOL classFound = NO;
+    PsiCashPurchasePrice *purchasePrice;
+    for (PsiCashPurchasePrice *pp in self->userInfo.purchasePrices) {
+        if (![pp.transactionClass isEqualToString:transactionClass]) {
+            continue;
+        }
+        classFound = YES;
+        if ([pp.distinguisher isEqualToString:transactionDistinguisher]) {
+            purchasePrice = pp;
+            break;
+        }
+    }
+
+    if (!classFound) {
+        // We know nothing about the class. It may not have been requested in
+        // refreshState, or it may not exist. Only the server can say.
+        return PsiCashStatus_Success;
+    }
+
+    if (!purchasePrice) {
+        return PsiCashStatus_TransactionTypeNotFound;
+    }
+
+    if (purchasePrice.price.longLongValue != expectedPrice.longLongValue) {
+        return PsiCashStatus_TransactionAmountMismatch;
+    }
+
+    for (PsiCashPurchase *purchase in [self validPurchases]) {
+        if ([purchase.transactionClass isEqualToString:transactionClass]) {
+            return PsiCashStatus_ExistingTransaction;
+        }
+    }
+
+    NSNumber *balance = self->userInfo.balance;
+    if (balance && balance.longLongValue < expectedPrice.longLongValue) {
+        return PsiCashStatus_InsufficientBalance;
+    }
+
+    return PsiCashStatus_Success;
+}
+
+- (RequestBuilder*_Nonnull)createNewTransactionRequestBuilderForClass:(NSString*_Nonnull)transactionClass
+                                                    withDistinguisher:(NSString*_Nonnull)transactionDistinguisher
+                                                    withExpectedPrice:(NSNumber*_Nonnull)expectedPrice
+{
+    NSMutableArray *queryItems = [[NSMutableArray alloc] init];
+    [queryItems addObject:[NSURLQueryItem queryItemWithName:@"class"
+                                                      value:transactionClass]];
+    [queryItems addObject:[NSURLQueryItem queryItemWithName:@"distinguisher"
+                                                      value:transactionDistinguisher]];
+
+    // Note the conversion from positive to negative: price to amount.
+    [queryItems addObject:[NSURLQueryItem queryItemWithName:@"expectedAmount"
+                                                      value:[NSString stringWithFormat:@"-%lld", expectedPrice.longLongValue]]];
+
+    return [self createRequestBuilderFor:@"/transaction"
+                              withMethod:@"POST"
+                          withQueryItems:queryItems
+                       includeAuthTokens:YES];
+}
+
+/*! Helper. Interprets the result of a transaction request. Doesn't modify the
+    stored state: the resulting purchase and balance (each nil if not available)
+    are returned for the caller to store. If the returned status is
+    PsiCashStatus_Invalid, error may be set. */
+- (PsiCashStatus)processNewTransactionResponse:(NSHTTPURLResponse*_Nullable)response
+                                          data:(NSData*_Nullable)data
+                                  requestError:(NSError*_Nullable)requestError
+                              transactionClass:(NSString*_Nonnull)transactionClass
+                             withDistinguisher:(NSString*_Nonnull)transactionDistinguisher
+                                      purchase:(PsiCashPurchase*_Nullable*_Nonnull)purchase
+                                       balance:(NSNumber*_Nullable*_Nonnull)balance
+                                         error:(NSError*_Nullable*_Nonnull)error
+{
+    *purchase = nil;
+    *balance = nil;
+    *error = nil;
+
+    if (requestError) {
+        *error = [NSError errorWrapping:requestError withMessage:@"request error" fromFunction:__FUNCTION__];
+        return PsiCashStatus_Invalid;
+    }
+
+    NSDate *serverTimeExpiry;
+    NSString *transactionID, *authorization;
+
+    if (response.statusCode == kHTTPStatusOK ||
+        response.statusCode == kHTTPStatusTooManyRequests ||
+        response.statusCode == kHTTPStatusPaymentRequired ||
+        response.statusCode == kHTTPStatusConflict) {
+        if (!data || data.length == 0) {
+            *error = [NSError errorWithMessage:@"request returned no data" fromFunction:__FUNCTION__];
+            return PsiCashStatus_Invalid;
+        }
+
+        NSNumber *transactionAmount, *parsedBalance;
+        NSError *parseError;
+
+        [PsiCash parseNewTransactionResponse:data
+                           transactionAmount:&transactionAmount
+                                     balance:&parsedBalance
+                                      expiry:&serverTimeExpiry
+                               transactionID:&transactionID
+                               authorization:&authorization
+                                   withError:&parseError];
+        if (parseError != nil) {
+            *error = [NSError errorWrapping:parseError withMessage:@"" fromFunction:__FUNCTION__];
+            return PsiCashStatus_Invalid;
+        }
+
+        *balance = parsedBalance;
+    }
+
+    if (response.statusCode == kHTTPStatusOK) {
+        *purchase = [[PsiCashPurchase alloc] initWithID:transactionID
+                                       transactionClass:transactionClass
+                                          distinguisher:transactionDistinguisher
+                                       serverTimeExpiry:serverTimeExpiry
+                                        localTimeExpiry:[self adjustServerTimeToLocal:serverTimeExpiry]
+                                          authorization:authorization];
+        return PsiCashStatus_Success;
+    }
+    else if (response.statusCode == kHTTPStatusTooManyRequests) {
+        return PsiCashStatus_ExistingTransaction;
+    }
+    else if (response.statusCode == kHTTPStatusPaymentRequired) {
+        return PsiCashStatus_InsufficientBalance;
+    }
+    else if (response.statusCode == kHTTPStatusConflict) {
+        return PsiCashStatus_TransactionAmountMismatch;
+    }
+    else if (response.statusCode == kHTTPStatusNotFound) {
+        return PsiCashStatus_TransactionTypeNotFound;
+    }
+    else if (response.statusCode == kHTTPStatusUnauthorized) {
+        return PsiCashStatus_InvalidTokens;
+    }
+    else if (response.statusCode == kHTTPStatusInternalServerError) {
+        return PsiCashStatus_ServerError;
+    }
+
+    *error = [NSError errorWithMessage:[NSString stringWithFormat:@"request failure: %ld", response.statusCode]
+                          fromFunction:__FUNCTION__];
+    return PsiCashStatus_Invalid;
+}
+
 + (void)parseNewTransactionResponse:(NSData*)jsonData
                   transactionAmount:(NSNumber**)transactionAmount
                             balance:(NSNumber**)balance
@@ -1136,21 +1440,57 @@ long long const MAX_INITIAL_BALANCE = 100000000000LL;
     // Only does something when replaced by testing code.
 }
 
++ (void)sessionConfigurationMutator:(NSURLSessionConfiguration*)config
+{
+    // Only does something when replaced by testing code.
+}
+
++ (NSURLSessionConfiguration*_Nonnull)sessionConfiguration:(BOOL)useCache
+{
+    NSURLSessionConfiguration* config = NSURLSessionConfiguration.defaultSessionConfiguration.copy;
+    config.timeoutIntervalForRequest = TIMEOUT_SECS;
+
+    if (!useCache) {
+        config.requestCachePolicy = NSURLRequestReloadIgnoringCacheData;
+    }
+
+    [PsiCash sessionConfigurationMutator:config];
+
+    return config;
+}
+
 // If error is non-nil, data and response will be nil.
 - (void)doRequestWithRetry:(RequestBuilder*_Nonnull)requestBuilder
                   useCache:(BOOL)useCache
          completionHandler:(void (^_Nonnull)(NSData*_Nullable data,
                                              NSHTTPURLResponse*_Nullable response,
                                              NSError*_Nullable error))completionHandler
+{
+    [self doRequestWithRetry:requestBuilder
+                    useCache:useCache
+                     session:nil
+           completionHandler:completionHandler];
+}
+
+// If session is nil, a new one will be created for each attempt. Otherwise the
+// given session is used and useCache is ignored (it's part of the session configuration).
+- (void)doRequestWithRetry:(RequestBuilder*_Nonnull)requestBuilder
+                  useCache:(BOOL)useCache
+                   session:(NSURLSession*_Nullable)session
+         completionHandler:(void (^_Nonnull)(NSData*_Nullable data,
+                                             NSHTTPURLResponse*_Nullable response,
+                                             NSError*_Nullable error))completionHandler
 {
     [self doRequestWithRetryHelper:requestBuilder
                           useCache:useCache
+                           session:session
                    numberOfRetries:REQUEST_RETRY_LIMIT
                  completionHandler:completionHandler];
 }
 
 - (void)doRequestWithRetryHelper:(RequestBuilder*_Nonnull)requestBuilder
                         useCache:(BOOL)useCache
+                         session:(NSURLSession*_Nullable)sharedSession
                  numberOfRetries:(NSUInteger)numRetries // Set to REQUEST_RETRY_LIMIT on first call
                completionHandler:(void (^_Nonnull)(NSData*_Nullable data,
                                                    NSHTTPURLResponse*_Nullable response,
@@ -1163,16 +1503,15 @@ long long const MAX_INITIAL_BALANCE = 100000000000LL;
     NSUInteger attempt = REQUEST_RETRY_LIMIT - numRetries + 1;
     [requestBuilder setAttempt:attempt];
 
-    NSURLSessionConfiguration* config = NSURLSessionConfiguration.defaultSessionConfiguration.copy;
-    config.timeoutIntervalForRequest = TIMEOUT_SECS;
+    NSMutableURLRequest *request = [requestBuilder request];
 
-    if (!useCache) {
-        config.requestCachePolicy = NSURLRequestReloadIgnoringCacheData;
+    NSURLSession *session = sharedSession;
+    if (!session) {
+        session = [NSURLSession sessionWithConfiguration:[PsiCash sessionConfiguration:useCache]];
     }
 
-    NSMutableURLRequest *request = [requestBuilder request];
-
-    NSURLSession *session = [NSURLSession sessionWithConfiguration:config];
+    // Set just before the task is started.
+    __block NSDate *requestTime;
 
     NSURLSessionDataTask *dataTask =
         [session dataTaskWithRequest:request
@@ -1189,6 +1528,11 @@ long long const MAX_INITIAL_BALANCE = 100000000000LL;
              NSHTTPURLResponse* httpResponse = (NSHTTPURLResponse*)response;
              NSUInteger responseStatusCode = [httpResponse statusCode];
 
+             // Every response is usable for the server time, even if we're going to retry.
+             [self updateServerTimeDiff:httpResponse
+                            requestTime:requestTime
+                           responseTime:[NSDate date]];
+
              if (responseStatusCode >= 500 && remainingRetries > 0) {
                  // Server is having trouble. Retry.
 
@@ -1201,14 +1545,13 @@ long long const MAX_INITIAL_BALANCE = 100000000000LL;
                      // Recursive retry.
                      [weakSelf doRequestWithRetryHelper:requestBuilder
                                                useCache:useCache
+                                                session:sharedSession
                                         numberOfRetries:remainingRetries
                                       completionHandler:completionHandler];
                  });
                  return;
              }
              else {
-                 self->userInfo.serverTimeDiff = [PsiCash serverTimeDiff:httpResponse];
-
                  // Success or no more retries available.
                  dispatch_async(self->completionQueue, ^{
                      completionHandler(data, httpResponse, nil);
@@ -1217,6 +1560,7 @@ long long const MAX_INITIAL_BALANCE = 100000000000LL;
              }
          }];
 
+    requestTime = [NSDate date];
     [dataTask resume];
 }
 
@@ -1254,30 +1598,29 @@ long long const MAX_INITIAL_BALANCE = 100000000000LL;
     return authTokensString;
 }
 
-+ (NSTimeInterval)serverTimeDiff:(NSHTTPURLResponse*)response
+/*! Updates the server time diff estimate with the given response. The stored
+ serverTimeDiff is only changed when the new estimate differs from it by more
+ than the estimate's uncertainty (and more than SERVER_TIME_DIFF_MIN_CHANGE_SECS),
+ to avoid expiry jitter and needless writes. */
+- (void)updateServerTimeDiff:(NSHTTPURLResponse*_Nonnull)response
+                 requestTime:(NSDate*_Nonnull)requestTime
+                responseTime:(NSDate*_Nonnull)responseTime
 {
-    NSTimeInterval noDiff = 0.0;
-
-    if (!response) {
-        return noDiff;
+    if (![self->serverTimeEstimator addSampleFromResponse:response
+                                              requestTime:requestTime
+                                             responseTime:responseTime]) {
+        return;
     }
 
-    NSString *serverDateString = response.allHeaderFields[@"Date"];
-    if (!serverDateString) {
-        NSLog(@"Server date header absent");
-        return noDiff;
+    NSTimeInterval serverTimeDiff, uncertainty;
+    if (![self->serverTimeEstimator serverTimeDiff:&serverTimeDiff uncertainty:&uncertainty]) {
+        return;
     }
 
-    NSDateFormatter *dateFormatter = [[NSDateFormatter alloc] init];
-    [dateFormatter setDateFormat:@"EEE',' dd' 'MMM' 'yyyy HH':'mm':'ss zzz"];
-
-    NSDate *serverDate = [dateFormatter dateFromString:serverDateString];
-    if (!serverDate) {
-        NSLog(@"Server date parse fail");
-        return noDiff;
+    NSTimeInterval change = fabs(serverTimeDiff - self->userInfo.serverTimeDiff);
+    if (change > MAX(uncertainty, SERVER_TIME_DIFF_MIN_CHANGE_SECS)) {
+        self->userInfo.serverTimeDiff = serverTimeDiff;
     }
-
-    return serverDate.timeIntervalSinceNow;
 }
 
 /*! Modifies a date-time provided by the server to be in equivalent local time
@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+//
+//  PurchaseStore.h
+//  PsiCashLib
+//
+
+#ifndef PurchaseStore_h
+#define PurchaseStore_h
+
+#import <Foundation/Foundation.h>
+#import "Purchase.h"
+
+//
+// Compact in-memory storage for purchases.
+//
+// Each purchase is a fixed-size record: the transaction class and distinguisher
+// are indexes into a table of interned strings (there are only a few distinct
+// values), the expiry is a number, and the ID and authorization are UTF-8 bytes
+// in a shared buffer. (The rare string that can't be UTF-8 encoded, such as one
+// with a lone surrogate, is kept as an NSString instead, so nothing is lost.)
+// PsiCashPurchase objects are only created when purchases are retrieved. Those
+// objects don't have localTimeExpiry populated.
+//
+// All times are server times.
+//
+// Not thread-safe. (UserInfo synchronizes access.)
+//
+
+@interface PurchaseStore : NSObject
+
+@property (readonly) NSUInteger count;
+
+- (id _Nonnull)init;
+
+//! Null items are skipped.
+- (id _Nonnull)initWithPurchases:(NSArray<PsiCashPurchase*>*_Nullable)purchases;
+
+- (void)addPurchase:(PsiCashPurchase*_Nonnull)purchase;
+
+//! Returns all purchases, in the order they were added.
+- (NSArray<PsiCashPurchase*>*_Nonnull)purchases;
+
+/*! Returns the purchases that have not expired at serverTime (including those
+    with no expiry), in the order they were added. */
+- (NSArray<PsiCashPurchase*>*_Nonnull)purchasesValidAt:(NSDate*_Nonnull)serverTime;
+
+//! Returns the purchase with the earliest expiry. Nil if no purchase has an expiry.
+- (PsiCashPurchase*_Nullable)nextExpiringPurchase;
+
+/*! Like nextExpiringPurchase, but only considers the purchases that
+    removeExpiredPurchasesAt:gracePeriod:maxExpired: would leave. Nothing is removed. */
+- (PsiCashPurchase*_Nullable)nextExpiringPurchaseRetainedAt:(NSDate*_Nonnull)serverTime
+                                                gracePeriod:(NSTimeInterval)gracePeriod
+                                                 maxExpired:(NSUInteger)maxExpired;
+
+/*! Removes the purchases with the given IDs. Returns YES if any were removed.
+    Items that aren't strings are ignored. */
+- (BOOL)removePurchasesWithIDs:(NSArray<NSString*>*_Nonnull)ids;
+
+/*! Removes purchases that have been expired for longer than gracePeriod at
+    serverTime. Then, if more than maxExpired of the remaining purchases have
+    expired, removes the earliest-expired until maxExpired are left. (So a
+    gracePeriod and maxExpired of 0 removes all expired purchases.)
+    Returns the removed purchases, in the order they were added. */
+- (NSArray<PsiCashPurchase*>*_Nonnull)removeExpiredPurchasesAt:(NSDate*_Nonnull)serverTime
+                                                   gracePeriod:(NSTimeInterval)gracePeriod
+                                                    maxExpired:(NSUInteger)maxExpired;
+
+/*! Returns the purchases that removeExpiredPurchasesAt:gracePeriod:maxExpired:
+    would leave, in the order they were added, without removing anything. */
+- (NSArray<PsiCashPurchase*>*_Nonnull)purchasesRetainedAt:(NSDate*_Nonnull)serverTime
+                                              gracePeriod:(NSTimeInterval)gracePeriod
+                                               maxExpired:(NSUInteger)maxExpired;
+
+//! Removes all purchases and interned strings.
+- (void)clear;
+
+@end
+
+#endif /* PurchaseStore_h */
@@ -0,0 +1,444 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+//
+//  PurchaseStore.m
+//  PsiCashLib
+//
+
+#import <Foundation/Foundation.h>
+#import "PurchaseStore.h"
+
+// Indicates a nil string, in place of a string index or length.
+uint32_t const PURCHASE_STORE_NIL = UINT32_MAX;
+// In place of a length, indicates a string that can't be UTF-8 encoded (such as
+// one with a lone surrogate). The offset is then an index into unencodableStrings.
+uint32_t const PURCHASE_STORE_UNENCODABLE = UINT32_MAX - 1;
+
+typedef struct {
+    NSTimeInterval serverTimeExpiry;    // Since the reference date. NAN if no expiry.
+    uint32_t transactionClass;          // Index into strings
+    uint32_t distinguisher;             // Index into strings
+    uint32_t idOffset;                  // Into bytes (or unencodableStrings)
+    uint32_t idLength;
+    uint32_t authorizationOffset;       // Into bytes (or unencodableStrings)
+    uint32_t authorizationLength;
+} PurchaseRecord;
+
+
+@implementation PurchaseStore {
+    NSMutableData *records;
+    NSMutableData *bytes;
+    NSMutableArray<NSString*> *strings;
+    NSMutableDictionary<NSString*, NSNumber*> *stringIndexes;
+    // IDs and authorizations that can't be stored as UTF-8. Expected to be rare.
+    NSMutableArray<NSString*> *unencodableStrings;
+}
+
+- (id _Nonnull)init
+{
+    return [self initWithPurchases:nil];
+}
+
+- (id _Nonnull)initWithPurchases:(NSArray<PsiCashPurchase*>*_Nullable)purchases
+{
+    [self clear];
+
+    for (id purchase in purchases) {
+        // The stored array may contain NSNull.
+        if (![purchase isKindOfClass:PsiCashPurchase.class]) {
+            continue;
+        }
+        [self addPurchase:purchase];
+    }
+
+    return self;
+}
+
+- (void)clear
+{
+    self->records = [NSMutableData data];
+    self->bytes = [NSMutableData data];
+    self->strings = [NSMutableArray array];
+    self->stringIndexes = [NSMutableDictionary dictionary];
+    self->unencodableStrings = [NSMutableArray array];
+}
+
+- (NSUInteger)count
+{
+    return self->records.length / sizeof(PurchaseRecord);
+}
+
+- (void)addPurchase:(PsiCashPurchase*_Nonnull)purchase
+{
+    PurchaseRecord record;
+    record.serverTimeExpiry = purchase.serverTimeExpiry ? purchase.serverTimeExpiry.timeIntervalSinceReferenceDate : NAN;
+    record.transactionClass = [self intern:purchase.transactionClass];
+    record.distinguisher = [self intern:purchase.distinguisher];
+    [self appendString:purchase.ID
+                offset:&record.idOffset
+                length:&record.idLength];
+    [self appendString:purchase.authorization
+                offset:&record.authorizationOffset
+                length:&record.authorizationLength];
+
+    [self->records appendBytes:&record length:sizeof(record)];
+}
+
+- (NSArray<PsiCashPurchase*>*_Nonnull)purchases
+{
+    PurchaseRecord const *recs = self->records.bytes;
+    NSUInteger count = self.count;
+
+    NSMutableArray<PsiCashPurchase*> *purchases = [NSMutableArray arrayWithCapacity:count];
+    for (NSUInteger i = 0; i < count; i++) {
+        [purchases addObject:[self purchaseFromRecord:&recs[i]]];
+    }
+    return purchases;
+}
+
+- (NSArray<PsiCashPurchase*>*_Nonnull)purchasesValidAt:(NSDate*_Nonnull)serverTime
+{
+    NSTimeInterval now = serverTime.timeIntervalSinceReferenceDate;
+    PurchaseRecord const *recs = self->records.bytes;
+    NSUInteger count = self.count;
+
+    NSMutableArray<PsiCashPurchase*> *purchases = [NSMutableArray array];
+    for (NSUInteger i = 0; i < count; i++) {
+        if (isnan(recs[i].serverTimeExpiry) || recs[i].serverTimeExpiry >= now) {
+            [purchases addObject:[self purchaseFromRecord:&recs[i]]];
+        }
+    }
+    return purchases;
+}
+
+- (PsiCashPurchase*_Nullable)nextExpiringPurchase
+{
+    return [self nextExpiringPurchaseExcluding:nil];
+}
+
+- (PsiCashPurchase*_Nullable)nextExpiringPurchaseRetainedAt:(NSDate*_Nonnull)serverTime
+                                                gracePeriod:(NSTimeInterval)gracePeriod
+                                                 maxExpired:(NSUInteger)maxExpired
+{
+    return [self nextExpiringPurchaseExcluding:[self indexesOfExpiredRecordsAt:serverTime
+                                                                   gracePeriod:gracePeriod
+                                                                    maxExpired:maxExpired]];
+}
+
+- (BOOL)removePurchasesWithIDs:(NSArray<NSString*>*_Nonnull)ids
+{
+    if (ids.count == 0) {
+        return NO;
+    }
+
+    // Compare the stored bytes directly, rather than creating strings.
+    NSMutableSet<NSData*> *idData = [NSMutableSet setWithCapacity:ids.count];
+    NSMutableSet<NSString*> *unencodableIDs = [NSMutableSet set];
+    for (id purchaseID in ids) {
+        // Skip anything that can't be a stored ID, rather than crash.
+        if (![purchaseID isKindOfClass:NSString.class]) {
+            continue;
+        }
+        NSData *data = [purchaseID dataUsingEncoding:NSUTF8StringEncoding];
+        if (data) {
+            [idData addObject:data];
+        }
+        else {
+            [unencodableIDs addObject:purchaseID];
+        }
+    }
+
+    PurchaseRecord const *recs = self->records.bytes;
+    NSUInteger count = self.count;
+
+    NSMutableIndexSet *indexesToRemove = [[NSMutableIndexSet alloc] init];
+    for (NSUInteger i = 0; i < count; i++) {
+        if (recs[i].idLength == PURCHASE_STORE_NIL) {
+            continue;
+        }
+        if (recs[i].idLength == PURCHASE_STORE_UNENCODABLE) {
+            if ([unencodableIDs containsObject:self->unencodableStrings[recs[i].idOffset]]) {
+                [indexesToRemove addIndex:i];
+            }
+            continue;
+        }
+        NSData *recordID = [NSData dataWithBytesNoCopy:(char*)self->bytes.bytes + recs[i].idOffset
+                                                length:recs[i].idLength
+                                          freeWhenDone:NO];
+        if ([idData containsObject:recordID]) {
+            [indexesToRemove addIndex:i];
+        }
+    }
+
+    [self removeRecordsAtIndexes:indexesToRemove];
+
+    return indexesToRemove.count > 0;
+}
+
+- (NSArray<PsiCashPurchase*>*_Nonnull)purchasesRetainedAt:(NSDate*_Nonnull)serverTime
+                                              gracePeriod:(NSTimeInterval)gracePeriod
+                                               maxExpired:(NSUInteger)maxExpired
+{
+    NSIndexSet *indexesToRemove = [self indexesOfExpiredRecordsAt:serverTime
+                                                      gracePeriod:gracePeriod
+                                                       maxExpired:maxExpired];
+    PurchaseRecord const *recs = self->records.bytes;
+    NSUInteger count = self.count;
+
+    NSMutableArray<PsiCashPurchase*> *purchases = [NSMutableArray arrayWithCapacity:count - indexesToRemove.count];
+    for (NSUInteger i = 0; i < count; i++) {
+        if (![indexesToRemove containsIndex:i]) {
+            [purchases addObject:[self purchaseFromRecord:&recs[i]]];
+        }
+    }
+    return purchases;
+}
+
+- (NSArray<PsiCashPurchase*>*_Nonnull)removeExpiredPurchasesAt:(NSDate*_Nonnull)serverTime
+                                                   gracePeriod:(NSTimeInterval)gracePeriod
+                                                    maxExpired:(NSUInteger)maxExpired
+{
+    NSIndexSet *indexesToRemove = [self indexesOfExpiredRecordsAt:serverTime
+                                                      gracePeriod:gracePeriod
+                                                       maxExpired:maxExpired];
+    PurchaseRecord const *recs = self->records.bytes;
+
+    NSMutableArray<PsiCashPurchase*> *removed = [NSMutableArray arrayWithCapacity:indexesToRemove.count];
+    [indexesToRemove enumerateIndexesUsingBlock:^(NSUInteger i, BOOL *stop) {
+        [removed addObject:[self purchaseFromRecord:&recs[i]]];
+    }];
+
+    [self removeRecordsAtIndexes:indexesToRemove];
+
+    return removed;
+}
+
+#pragma mark - helpers
+
+/*! Returns the purchase with the earliest expiry, ignoring the records at
+    excludedIndexes. Only the returned purchase is materialized. */
+- (PsiCashPurchase*_Nullable)nextExpiringPurchaseExcluding:(NSIndexSet*_Nullable)excludedIndexes
+{
+    PurchaseRecord const *recs = self->records.bytes;
+    NSUInteger count = self.count;
+
+    PurchaseRecord const *next = NULL;
+    for (NSUInteger i = 0; i < count; i++) {
+        if (isnan(recs[i].serverTimeExpiry) || [excludedIndexes containsIndex:i]) {
+            continue;
+        }
+        if (!next || recs[i].serverTimeExpiry < next->serverTimeExpiry) {
+            next = &recs[i];
+        }
+    }
+
+    return next ? [self purchaseFromRecord:next] : nil;
+}
+
+/*! Returns the indexes of the records that removeExpiredPurchasesAt:gracePeriod:maxExpired:
+    removes. */
+- (NSIndexSet*_Nonnull)indexesOfExpiredRecordsAt:(NSDate*_Nonnull)serverTime
+                                     gracePeriod:(NSTimeInterval)gracePeriod
+                                      maxExpired:(NSUInteger)maxExpired
+{
+    NSTimeInterval now = serverTime.timeIntervalSinceReferenceDate;
+    NSTimeInterval cutoff = now - gracePeriod;
+    PurchaseRecord const *recs = self->records.bytes;
+    NSUInteger count = self.count;
+
+    NSMutableIndexSet *indexes = [[NSMutableIndexSet alloc] init];
+    NSMutableArray<NSNumber*> *expiredIndexes = [NSMutableArray array];
+
+    for (NSUInteger i = 0; i < count; i++) {
+        NSTimeInterval expiry = recs[i].serverTimeExpiry;
+        if (isnan(expiry) || expiry >= now) {
+            continue;
+        }
+
+        if (expiry < cutoff) {
+            [indexes addIndex:i];
+        }
+        else {
+            [expiredIndexes addObject:@(i)];
+        }
+    }
+
+    if (expiredIndexes.count > maxExpired) {
+        [expiredIndexes sortUsingComparator:^NSComparisonResult(NSNumber *a, NSNumber *b) {
+            NSTimeInterval aExpiry = recs[a.unsignedIntegerValue].serverTimeExpiry;
+            NSTimeInterval bExpiry = recs[b.unsignedIntegerValue].serverTimeExpiry;
+            return aExpiry < bExpiry ? NSOrderedAscending : (aExpiry > bExpiry ? NSOrderedDescending : NSOrderedSame);
+        }];
+
+        for (NSUInteger i = 0; i < expiredIndexes.count - maxExpired; i++) {
+            [indexes addIndex:expiredIndexes[i].unsignedIntegerValue];
+        }
+    }
+
+    return indexes;
+}
+
+- (uint32_t)intern:(NSString*_Nullable)string
+{
+    if (!string) {
+        return PURCHASE_STORE_NIL;
+    }
+
+    NSNumber *index = self->stringIndexes[string];
+    if (index) {
+        return index.unsignedIntValue;
+    }
+
+    uint32_t newIndex = (uint32_t)self->strings.count;
+    NSString *interned = [string copy];
+    [self->strings addObject:interned];
+    self->stringIndexes[interned] = @(newIndex);
+    return newIndex;
+}
+
+- (NSString*_Nullable)internedString:(uint32_t)index
+{
+    return index == PURCHASE_STORE_NIL ? nil : self->strings[index];
+}
+
+- (void)appendString:(NSString*_Nullable)string
+              offset:(uint32_t*_Nonnull)offset
+              length:(uint32_t*_Nonnull)length
+{
+    *offset = (uint32_t)self->bytes.length;
+
+    if (!string) {
+        *length = PURCHASE_STORE_NIL;
+        return;
+    }
+
+    NSData *utf8 = [string dataUsingEncoding:NSUTF8StringEncoding];
+    if (!utf8) {
+        // Keep the string itself, so that it isn't lost or altered.
+        *offset = (uint32_t)self->unencodableStrings.count;
+        *length = PURCHASE_STORE_UNENCODABLE;
+        [self->unencodableStrings addObject:[string copy]];
+        return;
+    }
+
+    *length = (uint32_t)utf8.length;
+    [self->bytes appendData:utf8];
+}
+
+- (NSString*_Nullable)stringAtOffset:(uint32_t)offset length:(uint32_t)length
+{
+    if (length == PURCHASE_STORE_NIL) {
+        return nil;
+    }
+    if (length == PURCHASE_STORE_UNENCODABLE) {
+        return self->unencodableStrings[offset];
+    }
+
+    return [[NSString alloc] initWithBytes:(char const*)self->bytes.bytes + offset
+                                    length:length
+                                  encoding:NSUTF8StringEncoding];
+}
+
+- (PsiCashPurchase*_Nonnull)purchaseFromRecord:(PurchaseRecord const*_Nonnull)record
+{
+    NSDate *serverTimeExpiry;
+    if (!isnan(record->serverTimeExpiry)) {
+        serverTimeExpiry = [NSDate dateWithTimeIntervalSinceReferenceDate:record->serverTimeExpiry];
+    }
+
+    return [[PsiCashPurchase alloc] initWithID:[self stringAtOffset:record->idOffset length:record->idLength]
+                              transactionClass:[self internedString:record->transactionClass]
+                                 distinguisher:[self internedString:record->distinguisher]
+                              serverTimeExpiry:serverTimeExpiry
+                               localTimeExpiry:nil
+                                 authorization:[self stringAtOffset:record->authorizationOffset
+                                                             length:record->authorizationLength]];
+}
+
+/*! Rebuilds the records and bytes without the given records, so that the space
+    used by removed IDs and authorizations is freed. */
+- (void)removeRecordsAtIndexes:(NSIndexSet*_Nonnull)indexes
+{
+    if (indexes.count == 0) {
+        return;
+    }
+
+    NSUInteger count = self.count;
+
+    if (indexes.count == count) {
+        // Also drops the interned strings.
+        [self clear];
+        return;
+    }
+
+    PurchaseRecord const *recs = self->records.bytes;
+    char const *oldBytes = self->bytes.bytes;
+
+    NSMutableData *newRecords = [NSMutableData dataWithCapacity:(count - indexes.count) * sizeof(PurchaseRecord)];
+    NSMutableData *newBytes = [NSMutableData dataWithCapacity:self->bytes.length];
+    NSMutableArray<NSString*> *newUnencodableStrings = [NSMutableArray array];
+
+    for (NSUInteger i = 0; i < count; i++) {
+        if ([indexes containsIndex:i]) {
+            continue;
+        }
+
+        PurchaseRecord record = recs[i];
+
+        record.idOffset = [self copyStringAtOffset:record.idOffset
+                                            length:record.idLength
+                                         fromBytes:oldBytes
+                                           toBytes:newBytes
+                                unencodableStrings:newUnencodableStrings];
+        record.authorizationOffset = [self copyStringAtOffset:record.authorizationOffset
+                                                       length:record.authorizationLength
+                                                    fromBytes:oldBytes
+                                                      toBytes:newBytes
+                                           unencodableStrings:newUnencodableStrings];
+
+        [newRecords appendBytes:&record length:sizeof(record)];
+    }
+
+    self->records = newRecords;
+    self->bytes = newBytes;
+    self->unencodableStrings = newUnencodableStrings;
+}
+
+/*! Helper for removeRecordsAtIndexes:. Copies a string stored at offset and
+    length into the new storage and returns its new offset. */
+- (uint32_t)copyStringAtOffset:(uint32_t)offset
+                        length:(uint32_t)length
+                     fromBytes:(char const*_Nonnull)oldBytes
+                       toBytes:(NSMutableData*_Nonnull)newBytes
+            unencodableStrings:(NSMutableArray<NSString*>*_Nonnull)newUnencodableStrings
+{
+    if (length == PURCHASE_STORE_UNENCODABLE) {
+        [newUnencodableStrings addObject:self->unencodableStrings[offset]];
+        return (uint32_t)newUnencodableStrings.count - 1;
+    }
+
+    uint32_t newOffset = (uint32_t)newBytes.length;
+    if (length != PURCHASE_STORE_NIL) {
+        [newBytes appendBytes:oldBytes + offset length:length];
+    }
+    return newOffset;
+}
+
+@end
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+//
+//  ServerTimeEstimator.h
+//  PsiCashLib
+//
+
+#ifndef ServerTimeEstimator_h
+#define ServerTimeEstimator_h
+
+#import <Foundation/Foundation.h>
+
+//
+// Estimates the difference between the server clock and the local clock from
+// the Date headers of server responses.
+//
+// Each response bounds the difference: the server produced its Date value
+// sometime between when the request was sent and when the response was
+// received, and the value is truncated to the second. The estimate is taken
+// from the interval agreed on by the most samples in the window (Marzullo's
+// algorithm), so samples that disagree with the majority are rejected as
+// outliers and slow responses only contribute loose bounds. A new interval
+// must be agreed on by more samples than the current one to replace it.
+//
+// A change of the local clock is detected by comparing it with a monotonic
+// clock between samples. The older samples are then discarded, so the
+// estimate follows the change immediately.
+//
+
+@interface ServerTimeEstimator : NSObject
+
+//! windowSize is the number of most recent samples to use.
+- (id _Nonnull)initWithWindowSize:(NSUInteger)windowSize;
+
+/*! Adds a sample from the Date header of response. requestTime and responseTime
+    are the local times when the request was sent and the response received.
+    Returns NO if the response has no usable Date header. */
+- (BOOL)addSampleFromResponse:(NSHTTPURLResponse*_Nonnull)response
+                  requestTime:(NSDate*_Nonnull)requestTime
+                 responseTime:(NSDate*_Nonnull)responseTime;
+
+/*! Adds a sample. serverDate is the (1-second resolution) server time from the
+    response. */
+- (void)addSampleWithServerDate:(NSDate*_Nonnull)serverDate
+                    requestTime:(NSDate*_Nonnull)requestTime
+                   responseTime:(NSDate*_Nonnull)responseTime;
+
+/*! As above, with the monotonic time (Utils monotonicTime) at which the response
+    was received. (The above uses the current monotonic time.) */
+- (void)addSampleWithServerDate:(NSDate*_Nonnull)serverDate
+                    requestTime:(NSDate*_Nonnull)requestTime
+                   responseTime:(NSDate*_Nonnull)responseTime
+          monotonicResponseTime:(NSTimeInterval)monotonicResponseTime;
+
+/*! Returns NO if there are no samples. Otherwise sets serverTimeDiff to the
+    estimated server time minus local time, and uncertainty to the maximum error
+    of that estimate (i.e., the true difference is within ±uncertainty). */
+- (BOOL)serverTimeDiff:(NSTimeInterval*_Nonnull)serverTimeDiff
+           uncertainty:(NSTimeInterval*_Nonnull)uncertainty;
+
+//! Removes all samples.
+- (void)reset;
+
+//! Parses an HTTP Date header value. Returns nil on failure.
++ (NSDate*_Nullable)dateFromHTTPDateHeader:(NSString*_Nonnull)dateString;
+
+@end
+
+#endif /* ServerTimeEstimator_h */
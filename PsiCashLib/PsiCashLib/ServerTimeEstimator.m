@@ -0,0 +1,255 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+//
+//  ServerTimeEstimator.m
+//  PsiCashLib
+//
+
+#import <Foundation/Foundation.h>
+#import "ServerTimeEstimator.h"
+#import "Utils.h"
+
+// The resolution of the HTTP Date header. The server's time is truncated to this.
+NSTimeInterval const DATE_HEADER_RESOLUTION_SECS = 1.0;
+
+// If the local clock advanced by more than this much more (or less) than the
+// monotonic clock between two samples, the local clock was changed, and the
+// older samples are discarded.
+NSTimeInterval const LOCAL_CLOCK_CHANGE_THRESHOLD_SECS = 2.0;
+
+
+@implementation ServerTimeEstimator {
+    NSUInteger windowSize;
+    // Each sample is [lower, upper, local response time, monotonic response time],
+    // where lower and upper bound the server time diff. The times are used to
+    // detect local clock changes.
+    NSMutableArray<NSArray<NSNumber*>*> *samples;
+    // The current best interval. NAN if there are no samples.
+    NSTimeInterval bestLower, bestUpper;
+}
+
+- (id _Nonnull)initWithWindowSize:(NSUInteger)size
+{
+    self->windowSize = MAX(size, 1);
+    self->samples = [NSMutableArray arrayWithCapacity:self->windowSize];
+    self->bestLower = NAN;
+    self->bestUpper = NAN;
+    return self;
+}
+
+- (BOOL)addSampleFromResponse:(NSHTTPURLResponse*_Nonnull)response
+                  requestTime:(NSDate*_Nonnull)requestTime
+                 responseTime:(NSDate*_Nonnull)responseTime
+{
+    NSString *serverDateString = response.allHeaderFields[@"Date"];
+    if (!serverDateString) {
+        NSLog(@"Server date header absent");
+        return NO;
+    }
+
+    NSDate *serverDate = [ServerTimeEstimator dateFromHTTPDateHeader:serverDateString];
+    if (!serverDate) {
+        NSLog(@"Server date parse fail");
+        return NO;
+    }
+
+    [self addSampleWithServerDate:serverDate
+                      requestTime:requestTime
+                     responseTime:responseTime];
+    return YES;
+}
+
+- (void)addSampleWithServerDate:(NSDate*_Nonnull)serverDate
+                    requestTime:(NSDate*_Nonnull)requestTime
+                   responseTime:(NSDate*_Nonnull)responseTime
+{
+    [self addSampleWithServerDate:serverDate
+                      requestTime:requestTime
+                     responseTime:responseTime
+            monotonicResponseTime:[Utils monotonicTime]];
+}
+
+- (void)addSampleWithServerDate:(NSDate*_Nonnull)serverDate
+                    requestTime:(NSDate*_Nonnull)requestTime
+                   responseTime:(NSDate*_Nonnull)responseTime
+          monotonicResponseTime:(NSTimeInterval)monotonicResponseTime
+{
+    if ([responseTime compare:requestTime] == NSOrderedAscending) {
+        // The local clock was changed during the request. The sample is useless.
+        return;
+    }
+
+    // The server time was somewhere in [serverDate, serverDate+resolution) at
+    // some local time in [requestTime, responseTime].
+    NSTimeInterval lower = [serverDate timeIntervalSinceDate:responseTime];
+    NSTimeInterval upper = [serverDate timeIntervalSinceDate:requestTime] + DATE_HEADER_RESOLUTION_SECS;
+    NSTimeInterval localTime = responseTime.timeIntervalSinceReferenceDate;
+
+    @synchronized(self)
+    {
+        NSArray<NSNumber*> *last = self->samples.lastObject;
+        if (last) {
+            NSTimeInterval localElapsed = localTime - last[2].doubleValue;
+            NSTimeInterval monotonicElapsed = monotonicResponseTime - last[3].doubleValue;
+            if (fabs(localElapsed - monotonicElapsed) > LOCAL_CLOCK_CHANGE_THRESHOLD_SECS) {
+                // The local clock was changed since the last sample, so the older
+                // samples are all off by the change. (A change of the server's
+                // clock still has to win over the old samples.)
+                [self->samples removeAllObjects];
+                self->bestLower = NAN;
+                self->bestUpper = NAN;
+            }
+        }
+
+        [self->samples addObject:@[@(lower), @(upper), @(localTime), @(monotonicResponseTime)]];
+        if (self->samples.count > self->windowSize) {
+            [self->samples removeObjectAtIndex:0];
+        }
+
+        [ServerTimeEstimator bestIntervalOfSamples:self->samples
+                                      currentLower:self->bestLower
+                                      currentUpper:self->bestUpper
+                                             lower:&self->bestLower
+                                             upper:&self->bestUpper];
+    }
+}
+
+- (BOOL)serverTimeDiff:(NSTimeInterval*_Nonnull)serverTimeDiff
+           uncertainty:(NSTimeInterval*_Nonnull)uncertainty
+{
+    *serverTimeDiff = 0.0;
+    *uncertainty = 0.0;
+
+    NSTimeInterval lower, upper;
+    @synchronized(self)
+    {
+        lower = self->bestLower;
+        upper = self->bestUpper;
+    }
+
+    if (isnan(lower)) {
+        return NO;
+    }
+
+    *serverTimeDiff = (lower + upper) / 2.0;
+    *uncertainty = (upper - lower) / 2.0;
+
+    return YES;
+}
+
+- (void)reset
+{
+    @synchronized(self)
+    {
+        [self->samples removeAllObjects];
+        self->bestLower = NAN;
+        self->bestUpper = NAN;
+    }
+}
+
++ (NSDate*_Nullable)dateFromHTTPDateHeader:(NSString*_Nonnull)dateString
+{
+    static NSDateFormatter *formatter;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        formatter = [[NSDateFormatter alloc] init];
+        // Always use this locale when parsing fixed format date strings
+        formatter.locale = [[NSLocale alloc] initWithLocaleIdentifier:@"en_US_POSIX"];
+        formatter.dateFormat = @"EEE',' dd' 'MMM' 'yyyy HH':'mm':'ss zzz";
+    });
+
+    return [formatter dateFromString:dateString];
+}
+
+#pragma mark - helpers
+
+/*! Sets lower and upper to the bounds of the interval contained in the most
+    samples. An interval only replaces the current one (currentLower/currentUpper,
+    NAN if none) if more samples agree on it, so a single disagreeing sample
+    can't displace a single earlier one. Other ties go to the more recent samples.
+    Returns NO (and sets NAN) if there are no samples. */
++ (BOOL)bestIntervalOfSamples:(NSArray<NSArray<NSNumber*>*>*_Nonnull)samples
+                 currentLower:(NSTimeInterval)currentLower
+                 currentUpper:(NSTimeInterval)currentUpper
+                        lower:(NSTimeInterval*_Nonnull)lower
+                        upper:(NSTimeInterval*_Nonnull)upper
+{
+    *lower = NAN;
+    *upper = NAN;
+
+    if (samples.count == 0) {
+        return NO;
+    }
+
+    // Marzullo's algorithm: find the interval contained in the most samples.
+    // Each edge is [offset, type, sample index], where type is -1 for a lower
+    // bound and +1 for an upper bound. Lower bounds sort first at equal offsets,
+    // so that samples that just touch are considered to agree.
+    NSMutableArray<NSArray<NSNumber*>*> *edges = [NSMutableArray arrayWithCapacity:samples.count*2];
+    for (NSUInteger i = 0; i < samples.count; i++) {
+        [edges addObject:@[samples[i][0], @-1, @(i)]];
+        [edges addObject:@[samples[i][1], @1, @(i)]];
+    }
+
+    [edges sortUsingComparator:^NSComparisonResult(NSArray<NSNumber*> *a, NSArray<NSNumber*> *b) {
+        NSComparisonResult res = [a[0] compare:b[0]];
+        if (res != NSOrderedSame) {
+            return res;
+        }
+        return [a[1] compare:b[1]];
+    }];
+
+    // The samples containing the current point, by index (i.e., by recency).
+    NSMutableIndexSet *active = [[NSMutableIndexSet alloc] init];
+    NSUInteger bestCount = 0, bestNewest = 0;
+    BOOL bestIsCurrent = NO;
+    for (NSUInteger i = 0; i < edges.count; i++) {
+        if (edges[i][1].integerValue > 0) {
+            [active removeIndex:edges[i][2].unsignedIntegerValue];
+            continue;
+        }
+
+        [active addIndex:edges[i][2].unsignedIntegerValue];
+
+        // There is always a next edge after a lower bound.
+        NSTimeInterval candidateLower = edges[i][0].doubleValue;
+        NSTimeInterval candidateUpper = edges[i+1][0].doubleValue;
+        // (Comparisons with NAN are false.)
+        BOOL isCurrent = candidateLower <= currentUpper && candidateUpper >= currentLower;
+
+        BOOL better = active.count > bestCount;
+        if (active.count == bestCount) {
+            better = (isCurrent && !bestIsCurrent)
+                     || (isCurrent == bestIsCurrent && active.lastIndex > bestNewest);
+        }
+
+        if (better) {
+            bestCount = active.count;
+            bestNewest = active.lastIndex;
+            bestIsCurrent = isCurrent;
+            *lower = candidateLower;
+            *upper = candidateUpper;
+        }
+    }
+
+    return YES;
+}
+
+@end
@@ -39,11 +39,23 @@
 @property BOOL isAccount;
 @property NSNumber *balance;
 @property NSArray<PsiCashPurchasePrice*> *purchasePrices;
+/*! Purchases are stored compactly (see PurchaseStore) and materialized on every
+    read, without localTimeExpiry populated. Prefer the more specific accessors below. */
 @property NSArray<PsiCashPurchase*> *purchases;
+@property (readonly) NSUInteger purchasesCount;
 @property NSTimeInterval serverTimeDiff;
 @property NSString *lastTransactionID;
 @property NSDictionary<NSString*,id> *requestMetadata;
 
+/*! The time (Utils monotonicTime) at which both balance and purchasePrices
+    were last set from a server response in this session. Nil if either hasn't
+    been. Unaffected by changes to the device clock. Not persisted. */
+@property (readonly) NSNumber *_Nullable localStateMonotonicTime;
+
+/*! Changes whenever authTokens or requestMetadata change. Allows callers to
+    cache values derived from them. Not persisted. */
+@property (readonly) NSUInteger tokensAndMetadataVersion;
+
 - (id)init;
 
 //! Clears all user ID state.
@@ -55,6 +67,38 @@
 //! Add the given purchase to the stored purchases.
 - (void)addPurchase:(PsiCashPurchase*_Nonnull)purchase;
 
+/*! Add the given purchases to the stored purchases and, if non-nil, set the
+    balance, all at once. lastTransactionID is set to the last of the purchases. */
+- (void)addPurchases:(NSArray<PsiCashPurchase*>*_Nonnull)purchases
+         withBalance:(NSNumber*_Nullable)balance;
+
+//! Returns the stored purchases that haven't expired at serverTime.
+- (NSArray<PsiCashPurchase*>*_Nonnull)purchasesValidAt:(NSDate*_Nonnull)serverTime;
+
+/*! Returns the stored purchases that removeExpiredPurchasesAt:gracePeriod:maxExpired:
+    would leave, without modifying the stored purchases. */
+- (NSArray<PsiCashPurchase*>*_Nonnull)purchasesRetainedAt:(NSDate*_Nonnull)serverTime
+                                              gracePeriod:(NSTimeInterval)gracePeriod
+                                               maxExpired:(NSUInteger)maxExpired;
+
+//! Returns the stored purchase with the earliest expiry. May be nil.
+- (PsiCashPurchase*_Nullable)nextExpiringPurchase;
+
+/*! Returns the stored purchase with the earliest expiry, of those that
+    removeExpiredPurchasesAt:gracePeriod:maxExpired: would leave. May be nil. */
+- (PsiCashPurchase*_Nullable)nextExpiringPurchaseRetainedAt:(NSDate*_Nonnull)serverTime
+                                                gracePeriod:(NSTimeInterval)gracePeriod
+                                                 maxExpired:(NSUInteger)maxExpired;
+
+//! Remove the stored purchases with the given IDs.
+- (void)removePurchasesWithIDs:(NSArray<NSString*>*_Nonnull)ids;
+
+/*! Remove expired stored purchases. See PurchaseStore's method of the same name.
+    Returns the removed purchases. */
+- (NSArray<PsiCashPurchase*>*_Nonnull)removeExpiredPurchasesAt:(NSDate*_Nonnull)serverTime
+                                                   gracePeriod:(NSTimeInterval)gracePeriod
+                                                    maxExpired:(NSUInteger)maxExpired;
+
 //! Set a request metadata value at the given key.
 - (void)setRequestMetadataAtKey:(NSString*_Nonnull)k withValue:(id)v;
 
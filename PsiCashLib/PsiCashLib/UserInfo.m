@@ -24,6 +24,8 @@
 
 #import <Foundation/Foundation.h>
 #import "UserInfo.h"
+#import "PurchaseStore.h"
+#import "Utils.h"
 
 
 NSString * const TOKENS_DEFAULTS_KEY = @"Psiphon-PsiCash-UserInfo-Tokens";
@@ -38,19 +40,22 @@ NSString * const REQUEST_METADATA_DEFAULTS_KEY = @"Psiphon-PsiCash-UserInfo-Requ
 
 @interface UserInfo ()
 {
-    NSMutableArray<PsiCashPurchase*> *_purchases;
+    PurchaseStore *_purchaseStore;
     NSMutableDictionary<NSString*,id> *_requestMetadata;
 }
 @end
 
 @implementation UserInfo {
     NSInteger _isAccount;
+    // Utils monotonicTime values, which (unlike NSDate) aren't affected by clock changes.
+    NSNumber *_balanceMonotonicTime;
+    NSNumber *_purchasePricesMonotonicTime;
+    NSUInteger _tokensAndMetadataVersion;
 }
 
 @synthesize authTokens = _authTokens;
 @synthesize balance = _balance;
 @synthesize purchasePrices = _purchasePrices;
-@synthesize purchases = _purchases;
 @synthesize serverTimeDiff = _serverTimeDiff;
 @synthesize lastTransactionID = _lastTransactionID;
 @synthesize requestMetadata = _requestMetadata;
@@ -63,7 +68,7 @@ NSString * const REQUEST_METADATA_DEFAULTS_KEY = @"Psiphon-PsiCash-UserInfo-Requ
               isAccount:[defaults integerForKey:ISACCOUNT_DEFAULTS_KEY]];
     self->_balance = [defaults objectForKey:BALANCE_DEFAULTS_KEY];
     self->_purchasePrices = [NSKeyedUnarchiver unarchiveObjectWithData:[defaults objectForKey:PURCHASE_PRICES_DEFAULTS_KEY]];
-    self->_purchases = [NSKeyedUnarchiver unarchiveObjectWithData:[defaults objectForKey:PURCHASES_DEFAULTS_KEY]];
+    self->_purchaseStore = [[PurchaseStore alloc] initWithPurchases:[NSKeyedUnarchiver unarchiveObjectWithData:[defaults objectForKey:PURCHASES_DEFAULTS_KEY]]];
     self->_serverTimeDiff = [defaults doubleForKey:SERVER_TIME_DIFF_DEFAULTS_KEY];
     self->_lastTransactionID = [defaults stringForKey:LAST_TRANSACTION_ID_DEFAULTS_KEY];
     self->_requestMetadata = [[defaults objectForKey:REQUEST_METADATA_DEFAULTS_KEY] mutableCopy];
@@ -79,10 +84,14 @@ NSString * const REQUEST_METADATA_DEFAULTS_KEY = @"Psiphon-PsiCash-UserInfo-Requ
         [self setAuthTokens:emptyAuthTokens isAccount:NO];
         self.balance = @0;
         self.purchasePrices = @[];
-        self.purchases = [NSMutableArray array];
+        self.purchases = @[];
         self.serverTimeDiff = 0.0;
         self.lastTransactionID = nil;
         self.requestMetadata = [NSMutableDictionary dictionary];
+
+        // The values set above didn't come from the server.
+        self->_balanceMonotonicTime = nil;
+        self->_purchasePricesMonotonicTime = nil;
     }
 }
 
@@ -97,6 +106,7 @@ NSString * const REQUEST_METADATA_DEFAULTS_KEY = @"Psiphon-PsiCash-UserInfo-Requ
         [defaults setInteger:isAccount forKey:ISACCOUNT_DEFAULTS_KEY];
         self->_authTokens = authTokens;
         self->_isAccount = isAccount;
+        self->_tokensAndMetadataVersion += 1;
 
 #ifdef DEBUG
         NSLog(@"PsiCashLib::authTokens:%@", self->_authTokens);
@@ -143,6 +153,7 @@ NSString * const REQUEST_METADATA_DEFAULTS_KEY = @"Psiphon-PsiCash-UserInfo-Requ
     {
         [[NSUserDefaults standardUserDefaults] setValue:balance forKey:BALANCE_DEFAULTS_KEY];
         self->_balance = balance;
+        self->_balanceMonotonicTime = @([Utils monotonicTime]);
     }
 }
 
@@ -163,6 +174,7 @@ NSString * const REQUEST_METADATA_DEFAULTS_KEY = @"Psiphon-PsiCash-UserInfo-Requ
         NSData *data = [NSKeyedArchiver archivedDataWithRootObject:purchasePrices];
         [[NSUserDefaults standardUserDefaults] setObject:data forKey:PURCHASE_PRICES_DEFAULTS_KEY];
         self->_purchasePrices = purchasePrices;
+        self->_purchasePricesMonotonicTime = @([Utils monotonicTime]);
     }
 }
 
@@ -176,6 +188,28 @@ NSString * const REQUEST_METADATA_DEFAULTS_KEY = @"Psiphon-PsiCash-UserInfo-Requ
     return retVal;
 }
 
+- (NSNumber*)localStateMonotonicTime
+{
+    NSNumber *retVal;
+    @synchronized(self)
+    {
+        if (self->_balanceMonotonicTime && self->_purchasePricesMonotonicTime) {
+            retVal = @(MIN(self->_balanceMonotonicTime.doubleValue, self->_purchasePricesMonotonicTime.doubleValue));
+        }
+    }
+    return retVal;
+}
+
+- (NSUInteger)tokensAndMetadataVersion
+{
+    NSUInteger retVal;
+    @synchronized(self)
+    {
+        retVal = self->_tokensAndMetadataVersion;
+    }
+    return retVal;
+}
+
 - (void)setServerTimeDiff:(NSTimeInterval)serverTimeDiff
 {
     @synchronized(self)
@@ -185,34 +219,48 @@ NSString * const REQUEST_METADATA_DEFAULTS_KEY = @"Psiphon-PsiCash-UserInfo-Requ
     }
 }
 
-- (void)setPurchases:(NSArray<PsiCashPurchase*>*_Nonnull)purchases
+- (void)setPurchases:(NSArray<PsiCashPurchase*>*_Nullable)purchases
 {
     @synchronized(self)
     {
-        self->_purchases = [purchases mutableCopy];
+        // Null items are not kept.
+        self->_purchaseStore = [[PurchaseStore alloc] initWithPurchases:purchases];
+        [self persistPurchases];
+    }
+}
 
-        // Don't keep null items.
-        [self->_purchases removeObjectIdenticalTo:[NSNull null]];
+- (void)addPurchase:(PsiCashPurchase*_Nonnull)purchase
+{
+    @synchronized(self)
+    {
+        [self->_purchaseStore addPurchase:purchase];
+        [self persistPurchases];
 
-        NSData *data = [NSKeyedArchiver archivedDataWithRootObject:self->_purchases];
-        [[NSUserDefaults standardUserDefaults] setObject:data forKey:PURCHASES_DEFAULTS_KEY];
+        // Also set the lastTransactionID
+        self.lastTransactionID = purchase.ID;
     }
 }
 
-- (void)addPurchase:(PsiCashPurchase*_Nonnull)purchase
+- (void)addPurchases:(NSArray<PsiCashPurchase*>*_Nonnull)purchases
+         withBalance:(NSNumber*_Nullable)balance
 {
     @synchronized(self)
     {
-        if (!self->_purchases) {
-            self->_purchases = [NSMutableArray array];
+        if (balance) {
+            self.balance = balance;
         }
 
-        [self->_purchases addObject:purchase];
-        NSData *data = [NSKeyedArchiver archivedDataWithRootObject:self->_purchases];
-        [[NSUserDefaults standardUserDefaults] setObject:data forKey:PURCHASES_DEFAULTS_KEY];
+        if (purchases.count == 0) {
+            return;
+        }
 
-        // Also set the lastTransactionID
-        self.lastTransactionID = purchase.ID;
+        // Archive the list once, rather than once per purchase.
+        for (PsiCashPurchase *purchase in purchases) {
+            [self->_purchaseStore addPurchase:purchase];
+        }
+        [self persistPurchases];
+
+        self.lastTransactionID = purchases.lastObject.ID;
     }
 }
 
@@ -221,11 +269,104 @@ NSString * const REQUEST_METADATA_DEFAULTS_KEY = @"Psiphon-PsiCash-UserInfo-Requ
     NSArray<PsiCashPurchase*> *retVal;
     @synchronized(self)
     {
-        retVal = [self->_purchases copy];
+        retVal = [self->_purchaseStore purchases];
+    }
+    return retVal;
+}
+
+- (NSUInteger)purchasesCount
+{
+    NSUInteger retVal;
+    @synchronized(self)
+    {
+        retVal = self->_purchaseStore.count;
     }
     return retVal;
 }
 
+- (NSArray<PsiCashPurchase*>*_Nonnull)purchasesValidAt:(NSDate*_Nonnull)serverTime
+{
+    NSArray<PsiCashPurchase*> *retVal;
+    @synchronized(self)
+    {
+        retVal = [self->_purchaseStore purchasesValidAt:serverTime];
+    }
+    return retVal;
+}
+
+- (NSArray<PsiCashPurchase*>*_Nonnull)purchasesRetainedAt:(NSDate*_Nonnull)serverTime
+                                              gracePeriod:(NSTimeInterval)gracePeriod
+                                               maxExpired:(NSUInteger)maxExpired
+{
+    NSArray<PsiCashPurchase*> *retVal;
+    @synchronized(self)
+    {
+        retVal = [self->_purchaseStore purchasesRetainedAt:serverTime
+                                               gracePeriod:gracePeriod
+                                                maxExpired:maxExpired];
+    }
+    return retVal;
+}
+
+- (PsiCashPurchase*_Nullable)nextExpiringPurchase
+{
+    PsiCashPurchase *retVal;
+    @synchronized(self)
+    {
+        retVal = [self->_purchaseStore nextExpiringPurchase];
+    }
+    return retVal;
+}
+
+- (PsiCashPurchase*_Nullable)nextExpiringPurchaseRetainedAt:(NSDate*_Nonnull)serverTime
+                                                gracePeriod:(NSTimeInterval)gracePeriod
+                                                 maxExpired:(NSUInteger)maxExpired
+{
+    PsiCashPurchase *retVal;
+    @synchronized(self)
+    {
+        retVal = [self->_purchaseStore nextExpiringPurchaseRetainedAt:serverTime
+                                                          gracePeriod:gracePeriod
+                                                           maxExpired:maxExpired];
+    }
+    return retVal;
+}
+
+- (void)removePurchasesWithIDs:(NSArray<NSString*>*_Nonnull)ids
+{
+    @synchronized(self)
+    {
+        if ([self->_purchaseStore removePurchasesWithIDs:ids]) {
+            [self persistPurchases];
+        }
+    }
+}
+
+- (NSArray<PsiCashPurchase*>*_Nonnull)removeExpiredPurchasesAt:(NSDate*_Nonnull)serverTime
+                                                   gracePeriod:(NSTimeInterval)gracePeriod
+                                                    maxExpired:(NSUInteger)maxExpired
+{
+    NSArray<PsiCashPurchase*> *retVal;
+    @synchronized(self)
+    {
+        retVal = [self->_purchaseStore removeExpiredPurchasesAt:serverTime
+                                                    gracePeriod:gracePeriod
+                                                     maxExpired:maxExpired];
+        if (retVal.count > 0) {
+            [self persistPurchases];
+        }
+    }
+    return retVal;
+}
+
+/*! Helper. Must be called within @synchronized(self). The archive format is an
+    array of PsiCashPurchase, as it always has been. */
+- (void)persistPurchases
+{
+    NSData *data = [NSKeyedArchiver archivedDataWithRootObject:[self->_purchaseStore purchases]];
+    [[NSUserDefaults standardUserDefaults] setObject:data forKey:PURCHASES_DEFAULTS_KEY];
+}
+
 - (NSTimeInterval)serverTimeDiff
 {
     NSTimeInterval retVal;
@@ -262,6 +403,7 @@ NSString * const REQUEST_METADATA_DEFAULTS_KEY = @"Psiphon-PsiCash-UserInfo-Requ
         [[NSUserDefaults standardUserDefaults] setObject:requestMetadata forKey:REQUEST_METADATA_DEFAULTS_KEY];
 
         self->_requestMetadata = [requestMetadata mutableCopy];
+        self->_tokensAndMetadataVersion += 1;
     }
 }
 
@@ -274,6 +416,7 @@ NSString * const REQUEST_METADATA_DEFAULTS_KEY = @"Psiphon-PsiCash-UserInfo-Requ
         }
 
         self->_requestMetadata[k] = v;
+        self->_tokensAndMetadataVersion += 1;
         [[NSUserDefaults standardUserDefaults] setObject:self->_requestMetadata
                                                   forKey:REQUEST_METADATA_DEFAULTS_KEY];
     }
@@ -32,6 +32,17 @@
 
 + (NSString*_Nonnull)encodeURIComponent:(NSString*_Nonnull)string;
 
+/*! Seconds since an arbitrary point, from a monotonic clock that keeps counting
+    while the device sleeps and isn't affected by changes to the device clock.
+    (Unlike NSProcessInfo.systemUptime, which stops during sleep.) */
++ (NSTimeInterval)monotonicTime;
+
+/*! Encodes a query parameter value. This is URLQueryAllowedCharacterSet, as
+    NSURLComponents.queryItems uses, except that '&', '=', and '+' are also
+    encoded. NSURLComponents leaves '=' and '+' as-is, but servers commonly
+    decode a literal '+' in a query as a space, so we encode it as %2B. */
++ (NSString*_Nonnull)encodeQueryValue:(NSString*_Nonnull)string;
+
 @end
 
 #endif /* Utils_h */
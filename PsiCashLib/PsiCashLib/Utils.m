@@ -23,6 +23,7 @@
 //
 
 #import <Foundation/Foundation.h>
+#import <time.h>
 #import "Utils.h"
 
 @implementation Utils
@@ -63,4 +64,26 @@
     return encoded;
 }
 
++ (NSTimeInterval)monotonicTime
+{
+    // On Darwin, CLOCK_MONOTONIC includes time asleep (CLOCK_UPTIME_RAW doesn't).
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (NSTimeInterval)ts.tv_sec + (NSTimeInterval)ts.tv_nsec / NSEC_PER_SEC;
+}
+
++ (NSString*_Nonnull)encodeQueryValue:(NSString*_Nonnull)string
+{
+    static NSCharacterSet *allowedChars;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        NSMutableCharacterSet *chars = [[NSCharacterSet URLQueryAllowedCharacterSet] mutableCopy];
+        [chars removeCharactersInString:@"&=+"];
+        allowedChars = [chars copy];
+    });
+
+    NSString *encoded = [string stringByAddingPercentEncodingWithAllowedCharacters:allowedChars];
+    return encoded;
+}
+
 @end
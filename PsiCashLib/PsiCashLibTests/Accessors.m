@@ -743,6 +743,91 @@
     XCTAssertEqualObjects(result, expected);
 }
 
+- (void)testModifyLandingPages {
+    NSArray<NSString*> *urls = @[@"https://example.com",
+                                 @"https://example.com#anchor",
+                                 @"https://example.com?a=b",
+                                 @"https://example.com?#anchor",
+                                 @"https://example.com?a=b&#anchor",
+                                 @"http://sub.example.com/x/y/z.html?a=b#anchor"];
+    NSArray<NSString*> *results;
+    NSString *expected;
+    NSError *err;
+
+    [TestHelpers clearUserInfo:self->psiCash];
+    [[TestHelpers userInfo:self->psiCash] setAuthTokens:@{EARNER_TOKEN_TYPE: @"mytoken", @"faketype1": @"abcd"}
+                                              isAccount:NO];
+
+    // The batch results must match the individual results.
+    err = [self->psiCash modifyLandingPages:urls modifiedURLs:&results];
+    XCTAssertNil(err);
+    XCTAssertEqual(results.count, urls.count);
+    for (NSUInteger i = 0; i < urls.count; i++) {
+        err = [self->psiCash modifyLandingPage:urls[i] modifiedURL:&expected];
+        XCTAssertNil(err);
+        XCTAssertEqualObjects(results[i], expected);
+    }
+
+    expected = @"https://example.com?psicash=%7B%22metadata%22:%7B%22user_agent%22:%22Psiphon-PsiCash-iOS%22,%22v%22:1%7D,%22tokens%22:%22mytoken%22,%22v%22:2%7D#anchor";
+    XCTAssertEqualObjects(results[3], expected);
+
+    // Changing the metadata must change the data.
+    [self->psiCash setRequestMetadataAtKey:@"sponsor_id" withValue:@"mysponsorid"];
+    err = [self->psiCash modifyLandingPages:@[urls[0]] modifiedURLs:&results];
+    XCTAssertNil(err);
+    expected = @"https://example.com#psicash=%7B%22metadata%22%3A%7B%22sponsor%5Fid%22%3A%22mysponsorid%22%2C%22user%5Fagent%22%3A%22Psiphon%2DPsiCash%2DiOS%22%2C%22v%22%3A1%7D%2C%22tokens%22%3A%22mytoken%22%2C%22v%22%3A2%7D";
+    XCTAssertEqualObjects(results[0], expected);
+
+    // Changing the tokens must change the data.
+    [[TestHelpers userInfo:self->psiCash] setAuthTokens:@{@"faketype1": @"abcd"}
+                                              isAccount:NO];
+    err = [self->psiCash modifyLandingPages:@[urls[0]] modifiedURLs:&results];
+    XCTAssertNil(err);
+    expected = @"https://example.com#psicash=%7B%22metadata%22%3A%7B%22sponsor%5Fid%22%3A%22mysponsorid%22%2C%22user%5Fagent%22%3A%22Psiphon%2DPsiCash%2DiOS%22%2C%22v%22%3A1%7D%2C%22tokens%22%3Anull%2C%22v%22%3A2%7D";
+    XCTAssertEqualObjects(results[0], expected);
+
+    // '+' and '=' are encoded in the query form, so that '+' isn't read as a space.
+    [self->psiCash setRequestMetadataAtKey:@"sponsor_id" withValue:@"a+b=c"];
+    err = [self->psiCash modifyLandingPages:@[urls[3]] modifiedURLs:&results];
+    XCTAssertNil(err);
+    expected = @"https://example.com?psicash=%7B%22metadata%22:%7B%22sponsor_id%22:%22a%2Bb%3Dc%22,%22user_agent%22:%22Psiphon-PsiCash-iOS%22,%22v%22:1%7D,%22tokens%22:null,%22v%22:2%7D#anchor";
+    XCTAssertEqualObjects(results[0], expected);
+    [self->psiCash setRequestMetadataAtKey:@"sponsor_id" withValue:@"mysponsorid"];
+
+    // A bad URL is passed through unchanged, and the others are still modified.
+    err = [self->psiCash modifyLandingPages:@[@"http://汉", urls[0]] modifiedURLs:&results];
+    XCTAssertNotNil(err);
+    XCTAssertEqual(results.count, 2);
+    XCTAssertEqualObjects(results[0], @"http://汉");
+    XCTAssertEqualObjects(results[1], expected);
+
+    // Empty input
+    err = [self->psiCash modifyLandingPages:@[] modifiedURLs:&results];
+    XCTAssertNil(err);
+    XCTAssertEqual(results.count, 0);
+}
+
+- (void)testModifyLandingPagesPerformance {
+    [TestHelpers clearUserInfo:self->psiCash];
+    [[TestHelpers userInfo:self->psiCash] setAuthTokens:@{EARNER_TOKEN_TYPE: @"mytoken", @"faketype1": @"abcd"}
+                                              isAccount:NO];
+    [self->psiCash setRequestMetadataAtKey:@"client_region" withValue:@"myclientregion"];
+    [self->psiCash setRequestMetadataAtKey:@"sponsor_id" withValue:@"mysponsorid"];
+
+    NSArray<NSString*> *urls = @[@"https://example.com",
+                                 @"https://example.com/x/y/z.html?a=b",
+                                 @"https://sub.example.com/x/y/z.html?a=b#anchor"];
+
+    // Roughly 10,000 connections' worth of home pages.
+    [self measureBlock:^{
+        for (int i = 0; i < 10000; i++) {
+            NSArray<NSString*> *results;
+            NSError *err = [self->psiCash modifyLandingPages:urls modifiedURLs:&results];
+            XCTAssertNil(err);
+        }
+    }];
+}
+
 - (void)testGetRewardedActivityData {
     NSString *result;
     NSDictionary *expected;
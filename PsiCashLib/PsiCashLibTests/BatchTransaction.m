@@ -0,0 +1,435 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+//
+//  BatchTransaction.m
+//  PsiCashLibTests
+//
+
+#import <XCTest/XCTest.h>
+#import "TestHelpers.h"
+#import "SecretTestValues.h"
+#import "LocalTestServer.h"
+#import "HTTPStatusCodes.h"
+#import "Utils.h"
+
+
+@interface BatchTransactionTests : XCTestCase
+
+@property PsiCash *psiCash;
+
+@end
+
+@implementation BatchTransactionTests
+
+@synthesize psiCash;
+
+- (void)setUp {
+    [super setUp];
+    // Put setup code here. This method is called before the invocation of each test method in the class.
+
+    psiCash = [TestHelpers newPsiCash];
+}
+
+- (void)tearDown {
+    // Put teardown code here. This method is called after the invocation of each test method in the class.
+    [LocalTestServer stop];
+    [self->psiCash expirePurchases];
+    [super tearDown];
+}
+
++ (PsiCashPurchasePrice*)itemWithClass:(NSString*)transactionClass
+                         distinguisher:(NSString*)distinguisher
+                                 price:(long long)price
+{
+    PsiCashPurchasePrice *item = [[PsiCashPurchasePrice alloc] init];
+    item.transactionClass = transactionClass;
+    item.distinguisher = distinguisher;
+    item.price = @(price);
+    return item;
+}
+
+/*! Starts the local server with a responder that acts like the real server's
+    /transaction endpoint. Every distinguisher costs 100, except "missing", which
+    doesn't exist. Only one purchase per class is allowed. */
+- (void)startLocalTransactionServerWithBalance:(long long)initialBalance
+{
+    [LocalTestServer start];
+    [TestHelpers clearUserInfo:self->psiCash];
+
+    __block long long serverBalance = initialBalance;
+    __block int nextTransactionID = 1;
+    NSMutableSet<NSString*> *purchasedClasses = [NSMutableSet set];
+
+    [LocalTestServer setResponder:^(NSURLRequest *request, NSInteger *statusCode, NSData **body) {
+        NSURLComponents *components = [NSURLComponents componentsWithURL:request.URL resolvingAgainstBaseURL:NO];
+        NSString *transactionClass, *distinguisher;
+        long long expectedAmount = 0;
+        for (NSURLQueryItem *item in components.queryItems) {
+            if ([item.name isEqualToString:@"class"]) {
+                transactionClass = item.value;
+            }
+            else if ([item.name isEqualToString:@"distinguisher"]) {
+                distinguisher = item.value;
+            }
+            else if ([item.name isEqualToString:@"expectedAmount"]) {
+                expectedAmount = item.value.longLongValue;
+            }
+        }
+
+        NSMutableDictionary *response = [@{@"TransactionAmount": NSNull.null,
+                                           @"Balance": NSNull.null} mutableCopy];
+
+        @synchronized(purchasedClasses)
+        {
+            if ([distinguisher isEqualToString:@"missing"]) {
+                *statusCode = kHTTPStatusNotFound;
+                *body = nil;
+                return;
+            }
+
+            response[@"Balance"] = @(serverBalance);
+
+            if (expectedAmount != -100) {
+                *statusCode = kHTTPStatusConflict;
+            }
+            else if ([purchasedClasses containsObject:transactionClass]) {
+                *statusCode = kHTTPStatusTooManyRequests;
+            }
+            else if (serverBalance < 100) {
+                *statusCode = kHTTPStatusPaymentRequired;
+            }
+            else {
+                *statusCode = kHTTPStatusOK;
+                serverBalance -= 100;
+                [purchasedClasses addObject:transactionClass];
+
+                response[@"Balance"] = @(serverBalance);
+                response[@"TransactionAmount"] = @-100;
+                response[@"TransactionID"] = [NSString stringWithFormat:@"txid-%d", nextTransactionID++];
+                response[@"TransactionResponse"] = @{@"Type": @"expiring-purchase",
+                                                     @"Values": @{@"Expires": [Utils iso8601StringFromDate:[NSDate dateWithTimeIntervalSinceNow:3600]]}};
+            }
+        }
+
+        *body = [NSJSONSerialization dataWithJSONObject:response options:0 error:nil];
+    }];
+}
+
+- (NSArray<PsiCashPurchasePrice*>*)localItems:(int)count
+{
+    NSMutableArray<PsiCashPurchasePrice*> *items = [NSMutableArray array];
+    for (int i = 0; i < count; i++) {
+        [items addObject:[BatchTransactionTests itemWithClass:[NSString stringWithFormat:@"class-%d", i]
+                                                distinguisher:@"1hr"
+                                                        price:100]];
+    }
+    return items;
+}
+
+//! Makes the transactions one after the other, using the single-purchase method.
+- (void)makeSequentialTransactions:(NSArray<PsiCashPurchasePrice*>*)items
+                        completion:(void (^_Nonnull)(void))completionHandler
+{
+    [self makeSequentialTransactions:items
+                      expectedStatus:PsiCashStatus_Success
+                          completion:completionHandler];
+}
+
+- (void)makeSequentialTransactions:(NSArray<PsiCashPurchasePrice*>*)items
+                    expectedStatus:(PsiCashStatus)expectedStatus
+                        completion:(void (^_Nonnull)(void))completionHandler
+{
+    if (items.count == 0) {
+        completionHandler();
+        return;
+    }
+
+    PsiCashPurchasePrice *item = items[0];
+    [self->psiCash newExpiringPurchaseTransactionForClass:item.transactionClass
+                                        withDistinguisher:item.distinguisher
+                                        withExpectedPrice:item.price
+                                           withCompletion:^(PsiCashStatus status,
+                                                            PsiCashPurchase*_Nullable purchase,
+                                                            NSError*_Nullable error)
+     {
+         XCTAssertNil(error);
+         XCTAssertEqual(status, expectedStatus);
+
+         // Recurse
+         [self makeSequentialTransactions:[items subarrayWithRange:NSMakeRange(1, items.count-1)]
+                           expectedStatus:expectedStatus
+                               completion:completionHandler];
+     }];
+}
+
+- (void)testBasic {
+    // This test uses the real server. Make sure we have tokens.
+    XCTestExpectation *expTokens = [self expectationWithDescription:@"Init tokens"];
+    [psiCash refreshState:@[] withCompletion:^(PsiCashStatus status,
+                                               NSError * _Nullable error) {
+        XCTAssertNil(error);
+        XCTAssertEqual(status, PsiCashStatus_Success);
+        [expTokens fulfill];
+    }];
+    [self waitForExpectationsWithTimeout:100 handler:nil];
+
+    XCTestExpectation *exp = [self expectationWithDescription:@"Success: mixed batch"];
+
+    [TestHelpers makeRewardRequests:psiCash
+                             amount:1
+                         completion:^(BOOL success)
+     {
+         XCTAssert(success);
+
+         [self->psiCash refreshState:@[] withCompletion:^(PsiCashStatus status,
+                                                          NSError * _Nullable error) {
+             XCTAssertNil(error);
+             XCTAssertEqual(status, PsiCashStatus_Success);
+
+             NSNumber *prePurchaseBalance = [self->psiCash balance];
+             XCTAssertGreaterThanOrEqual(prePurchaseBalance.longLongValue, ONE_TRILLION);
+
+             NSArray<PsiCashPurchasePrice*> *items =
+                @[[BatchTransactionTests itemWithClass:@TEST_DEBIT_TRANSACTION_CLASS
+                                         distinguisher:@TEST_ONE_TRILLION_ONE_MICROSECOND_DISTINGUISHER
+                                                 price:ONE_TRILLION],
+                  [BatchTransactionTests itemWithClass:@TEST_DEBIT_TRANSACTION_CLASS
+                                         distinguisher:@"INVALID"
+                                                 price:TEST_INT64_MAX],
+                  [BatchTransactionTests itemWithClass:@TEST_DEBIT_TRANSACTION_CLASS
+                                         distinguisher:@TEST_INT64_MAX_DISTINGUISHER
+                                                 price:TEST_INT64_MAX-1]]; // MISMATCH!
+
+             [self->psiCash newExpiringPurchaseTransactions:items
+                                             withCompletion:^(NSArray<PsiCashMakePurchaseResultModel*> *results)
+              {
+                  XCTAssertEqual(results.count, items.count);
+
+                  XCTAssertEqual(results[0].status, PsiCashStatus_Success);
+                  XCTAssertNil(results[0].error);
+                  XCTAssertNotNil(results[0].purchase);
+                  XCTAssertNotNil(results[0].purchase.ID);
+                  XCTAssertNotNil(results[0].purchase.localTimeExpiry);
+
+                  XCTAssertEqual(results[1].status, PsiCashStatus_TransactionTypeNotFound);
+                  XCTAssertNil(results[1].purchase);
+
+                  XCTAssertEqual(results[2].status, PsiCashStatus_TransactionAmountMismatch);
+                  XCTAssertNil(results[2].purchase);
+
+                  XCTAssertEqual([self->psiCash balance].longLongValue, prePurchaseBalance.longLongValue - ONE_TRILLION);
+                  XCTAssert([results[0].purchase.ID isEqualToString:[[TestHelpers userInfo:self->psiCash] lastTransactionID]]);
+
+                  [exp fulfill];
+              }];
+         }];
+     }];
+
+    [self waitForExpectationsWithTimeout:100 handler:nil];
+}
+
+- (void)testEmpty {
+    XCTestExpectation *exp = [self expectationWithDescription:@"Success: empty batch"];
+
+    [self startLocalTransactionServerWithBalance:1000];
+
+    [self->psiCash newExpiringPurchaseTransactions:@[]
+                                    withCompletion:^(NSArray<PsiCashMakePurchaseResultModel*> *results)
+     {
+         XCTAssertEqual(results.count, 0);
+         XCTAssertEqual([LocalTestServer requestCount], 0);
+
+         [exp fulfill];
+     }];
+
+    [self waitForExpectationsWithTimeout:100 handler:nil];
+}
+
+- (void)testFasterThanSequential {
+    // This test uses the real server, so that connection setup is real. (The
+    // local server is an NSURLProtocol and doesn't make connections.) Get tokens,
+    // which also gets DNS and the like out of the way.
+    XCTestExpectation *expTokens = [self expectationWithDescription:@"Init tokens"];
+    [psiCash refreshState:@[] withCompletion:^(PsiCashStatus status,
+                                               NSError * _Nullable error) {
+        XCTAssertNil(error);
+        XCTAssertEqual(status, PsiCashStatus_Success);
+        [expTokens fulfill];
+    }];
+    [self waitForExpectationsWithTimeout:100 handler:nil];
+
+    XCTestExpectation *exp = [self expectationWithDescription:@"Batch vs sequential against server"];
+
+    // Price mismatches, so that nothing is bought and the items can be repeated.
+    int const itemCount = 5;
+    NSMutableArray<PsiCashPurchasePrice*> *items = [NSMutableArray array];
+    for (int i = 0; i < itemCount; i++) {
+        [items addObject:[BatchTransactionTests itemWithClass:@TEST_DEBIT_TRANSACTION_CLASS
+                                                distinguisher:@TEST_INT64_MAX_DISTINGUISHER
+                                                        price:TEST_INT64_MAX-1]];
+    }
+
+    NSDate *sequentialStart = [NSDate date];
+
+    [self makeSequentialTransactions:items
+                      expectedStatus:PsiCashStatus_TransactionAmountMismatch
+                          completion:^{
+        NSTimeInterval sequentialTime = -[sequentialStart timeIntervalSinceNow];
+
+        NSDate *batchStart = [NSDate date];
+
+        [self->psiCash newExpiringPurchaseTransactions:items
+                                        withCompletion:^(NSArray<PsiCashMakePurchaseResultModel*> *results)
+         {
+             NSTimeInterval batchTime = -[batchStart timeIntervalSinceNow];
+
+             for (PsiCashMakePurchaseResultModel *result in results) {
+                 XCTAssertEqual(result.status, PsiCashStatus_TransactionAmountMismatch);
+             }
+
+             NSLog(@"Batch of %d: %.3fs; sequential: %.3fs", itemCount, batchTime, sequentialTime);
+
+             // Both make the requests one at a time, but each sequential call sets
+             // up a new connection, while the batch reuses one.
+             XCTAssertLessThan(batchTime, sequentialTime);
+
+             [exp fulfill];
+         }];
+    }];
+
+    [self waitForExpectationsWithTimeout:100 handler:nil];
+}
+
+- (void)testPerItemResults {
+    XCTestExpectation *exp = [self expectationWithDescription:@"Per-item results from local server"];
+
+    // Enough for two purchases.
+    [self startLocalTransactionServerWithBalance:250];
+
+    NSArray<PsiCashPurchasePrice*> *items =
+        @[[BatchTransactionTests itemWithClass:@"speed-boost" distinguisher:@"1hr" price:100],
+          [BatchTransactionTests itemWithClass:@"speed-boost" distinguisher:@"2hr" price:100],
+          [BatchTransactionTests itemWithClass:@"other" distinguisher:@"missing" price:100],
+          [BatchTransactionTests itemWithClass:@"other" distinguisher:@"1hr" price:99],
+          [BatchTransactionTests itemWithClass:@"other" distinguisher:@"1hr" price:100],
+          [BatchTransactionTests itemWithClass:@"third" distinguisher:@"1hr" price:100]];
+
+    [self->psiCash newExpiringPurchaseTransactions:items
+                                    withCompletion:^(NSArray<PsiCashMakePurchaseResultModel*> *results)
+     {
+         XCTAssertEqual(results.count, items.count);
+
+         for (PsiCashMakePurchaseResultModel *result in results) {
+             XCTAssertFalse(result.inProgress);
+         }
+
+         // The requests are made in item order, so the first of each class
+         // succeeds, while the balance lasts.
+         XCTAssertEqual(results[0].status, PsiCashStatus_Success);
+         XCTAssertNotNil(results[0].purchase);
+         XCTAssertNil(results[0].error);
+         XCTAssertEqualObjects(results[0].purchase.distinguisher, @"1hr");
+         XCTAssertEqual(results[1].status, PsiCashStatus_ExistingTransaction);
+         XCTAssertNil(results[1].purchase);
+         XCTAssertEqual(results[2].status, PsiCashStatus_TransactionTypeNotFound);
+         XCTAssertNil(results[2].purchase);
+         XCTAssertEqual(results[3].status, PsiCashStatus_TransactionAmountMismatch);
+         XCTAssertNil(results[3].purchase);
+         XCTAssertEqual(results[4].status, PsiCashStatus_Success);
+         XCTAssertNotNil(results[4].purchase);
+         XCTAssertNil(results[4].error);
+         XCTAssertEqual(results[5].status, PsiCashStatus_InsufficientBalance);
+         XCTAssertNil(results[5].purchase);
+
+         // The final balance is stored.
+         XCTAssertEqual([self->psiCash balance].longLongValue, 50);
+
+         // The purchases are stored in item order.
+         NSArray<PsiCashPurchase*> *storedPurchases = [self->psiCash purchases];
+         XCTAssertEqual(storedPurchases.count, 2);
+         XCTAssertEqualObjects(storedPurchases[0].ID, @"txid-1");
+         XCTAssertEqualObjects(storedPurchases[1].ID, @"txid-2");
+         XCTAssertEqualObjects(results[0].purchase.ID, @"txid-1");
+         XCTAssertEqualObjects(results[4].purchase.ID, @"txid-2");
+         XCTAssertEqualObjects([[TestHelpers userInfo:self->psiCash] lastTransactionID], @"txid-2");
+
+         [exp fulfill];
+     }];
+
+    [self waitForExpectationsWithTimeout:100 handler:nil];
+}
+
+- (void)testFewerWritesThanSequential {
+    XCTestExpectation *exp = [self expectationWithDescription:@"Batch vs sequential"];
+
+    int const itemCount = 5;
+
+    __block int defaultsChanges = 0;
+    id observer = [[NSNotificationCenter defaultCenter] addObserverForName:NSUserDefaultsDidChangeNotification
+                                                                    object:nil
+                                                                     queue:nil
+                                                                usingBlock:^(NSNotification *note) {
+                                                                    defaultsChanges += 1;
+                                                                }];
+
+    // Sequential first.
+    [self startLocalTransactionServerWithBalance:10000];
+    defaultsChanges = 0;
+
+    [self makeSequentialTransactions:[self localItems:itemCount] completion:^{
+        int sequentialChanges = defaultsChanges;
+
+        XCTAssertEqual([self->psiCash purchases].count, itemCount);
+        XCTAssertEqual([self->psiCash balance].longLongValue, 10000 - 100*itemCount);
+
+        // Then the same purchases as a batch, against fresh state.
+        [self startLocalTransactionServerWithBalance:10000];
+        defaultsChanges = 0;
+
+        [self->psiCash newExpiringPurchaseTransactions:[self localItems:itemCount]
+                                        withCompletion:^(NSArray<PsiCashMakePurchaseResultModel*> *results)
+         {
+             int batchChanges = defaultsChanges;
+
+             [[NSNotificationCenter defaultCenter] removeObserver:observer];
+
+             for (PsiCashMakePurchaseResultModel *result in results) {
+                 XCTAssertEqual(result.status, PsiCashStatus_Success);
+             }
+
+             XCTAssertEqual([self->psiCash purchases].count, itemCount);
+             XCTAssertEqual([self->psiCash balance].longLongValue, 10000 - 100*itemCount);
+
+             // (LocalTestServer is an NSURLProtocol and doesn't use real
+             // connections, so timing comparisons against it are meaningless.)
+
+             // Sequential writes the balance, purchases, and last transaction ID
+             // per item; the batch writes each once. (Allow for a server time diff write.)
+             XCTAssertGreaterThanOrEqual(sequentialChanges, 3*itemCount);
+             XCTAssertLessThanOrEqual(batchChanges, 4);
+
+             [exp fulfill];
+         }];
+    }];
+
+    [self waitForExpectationsWithTimeout:100 handler:nil];
+}
+
+@end
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+//
+//  LocalTestServer.h
+//  PsiCashLibTests
+//
+
+#ifndef LocalTestServer_h
+#define LocalTestServer_h
+
+#import <Foundation/Foundation.h>
+
+//! Produces the status code and body for a request to the local server.
+typedef void (^LocalTestServerResponder)(NSURLRequest*_Nonnull request,
+                                         NSInteger*_Nonnull statusCode,
+                                         NSData*_Nullable*_Nonnull body);
+
+//
+// An in-process stand-in for the PsiCash server. While it's started, all PsiCash
+// requests are answered by it rather than going over the network. The server's
+// clock skew and the request and response latencies are controllable.
+//
+// Like the request mutators, this is global state. Let's hope these tests aren't concurrent!
+//
+@interface LocalTestServer : NSURLProtocol
+
+//! Starts answering requests. The default responder returns 200 with "{}".
++ (void)start;
++ (void)stop;
++ (BOOL)isStarted;
+
+//! Server clock minus local clock.
++ (void)setSkew:(NSTimeInterval)skew;
+
+//! requestLatency passes before the server sets its Date; responseLatency after.
++ (void)setRequestLatency:(NSTimeInterval)requestLatency
+          responseLatency:(NSTimeInterval)responseLatency;
+
++ (void)setResponder:(LocalTestServerResponder _Nullable)responder;
+
+//! The number of requests received since start.
++ (NSUInteger)requestCount;
+
+//! Adds this protocol to config if the server is started.
++ (void)installInSessionConfiguration:(NSURLSessionConfiguration*_Nonnull)config;
+
+@end
+
+#endif /* LocalTestServer_h */
@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+//
+//  LocalTestServer.m
+//  PsiCashLibTests
+//
+
+#import <Foundation/Foundation.h>
+#import "LocalTestServer.h"
+
+
+// Global vars, guarded by the class object.
+static BOOL started;
+static NSTimeInterval skew;
+static NSTimeInterval requestLatency;
+static NSTimeInterval responseLatency;
+static LocalTestServerResponder responder;
+static NSUInteger requestCount;
+
+
+@implementation LocalTestServer {
+    NSThread *clientThread;
+    BOOL stopped;
+}
+
++ (void)start
+{
+    @synchronized(self)
+    {
+        started = YES;
+        skew = 0.0;
+        requestLatency = 0.0;
+        responseLatency = 0.0;
+        responder = nil;
+        requestCount = 0;
+    }
+}
+
++ (void)stop
+{
+    @synchronized(self)
+    {
+        started = NO;
+        responder = nil;
+    }
+}
+
++ (BOOL)isStarted
+{
+    @synchronized(self)
+    {
+        return started;
+    }
+}
+
++ (void)setSkew:(NSTimeInterval)newSkew
+{
+    @synchronized(self)
+    {
+        skew = newSkew;
+    }
+}
+
++ (void)setRequestLatency:(NSTimeInterval)newRequestLatency
+          responseLatency:(NSTimeInterval)newResponseLatency
+{
+    @synchronized(self)
+    {
+        requestLatency = newRequestLatency;
+        responseLatency = newResponseLatency;
+    }
+}
+
++ (void)setResponder:(LocalTestServerResponder _Nullable)newResponder
+{
+    @synchronized(self)
+    {
+        responder = newResponder;
+    }
+}
+
++ (NSUInteger)requestCount
+{
+    @synchronized(self)
+    {
+        return requestCount;
+    }
+}
+
++ (void)installInSessionConfiguration:(NSURLSessionConfiguration*_Nonnull)config
+{
+    if (![LocalTestServer isStarted]) {
+        return;
+    }
+
+    config.protocolClasses = @[LocalTestServer.class];
+}
+
++ (NSString*_Nonnull)httpDateString:(NSDate*_Nonnull)date
+{
+    NSDateFormatter *formatter = [[NSDateFormatter alloc] init];
+    formatter.locale = [[NSLocale alloc] initWithLocaleIdentifier:@"en_US_POSIX"];
+    formatter.timeZone = [NSTimeZone timeZoneWithAbbreviation:@"GMT"];
+    formatter.dateFormat = @"EEE',' dd' 'MMM' 'yyyy HH':'mm':'ss 'GMT'";
+    return [formatter stringFromDate:date];
+}
+
+#pragma mark - NSURLProtocol
+
++ (BOOL)canInitWithRequest:(NSURLRequest*)request
+{
+    // Only installed in sessions while started.
+    return YES;
+}
+
++ (NSURLRequest*)canonicalRequestForRequest:(NSURLRequest*)request
+{
+    return request;
+}
+
+- (void)startLoading
+{
+    self->clientThread = [NSThread currentThread];
+
+    NSTimeInterval currentSkew, currentRequestLatency, currentResponseLatency;
+    LocalTestServerResponder currentResponder;
+    @synchronized(LocalTestServer.class)
+    {
+        requestCount += 1;
+        currentSkew = skew;
+        currentRequestLatency = requestLatency;
+        currentResponseLatency = responseLatency;
+        currentResponder = responder;
+    }
+
+    NSURLRequest *request = self.request;
+
+    dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0ul);
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(currentRequestLatency * NSEC_PER_SEC)), queue, ^{
+        NSInteger statusCode = 200;
+        NSData *body = [@"{}" dataUsingEncoding:NSUTF8StringEncoding];
+        if (currentResponder) {
+            currentResponder(request, &statusCode, &body);
+        }
+
+        NSDate *serverNow = [NSDate dateWithTimeIntervalSinceNow:currentSkew];
+        NSDictionary *headers = @{@"Date": [LocalTestServer httpDateString:serverNow],
+                                  @"Content-Type": @"application/json"};
+        NSHTTPURLResponse *response = [[NSHTTPURLResponse alloc] initWithURL:request.URL
+                                                                  statusCode:statusCode
+                                                                 HTTPVersion:@"HTTP/1.1"
+                                                                headerFields:headers];
+
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(currentResponseLatency * NSEC_PER_SEC)), queue, ^{
+            // The client must be called on the thread that started loading.
+            [self performSelector:@selector(deliverResponse:)
+                         onThread:self->clientThread
+                       withObject:@[response, body ? body : [NSData data]]
+                    waitUntilDone:NO];
+        });
+    });
+}
+
+- (void)stopLoading
+{
+    self->stopped = YES;
+}
+
+- (void)deliverResponse:(NSArray*)responseAndBody
+{
+    if (self->stopped) {
+        return;
+    }
+
+    [self.client URLProtocol:self
+          didReceiveResponse:responseAndBody[0]
+          cacheStoragePolicy:NSURLCacheStorageNotAllowed];
+    [self.client URLProtocol:self didLoadData:responseAndBody[1]];
+    [self.client URLProtocolDidFinishLoading:self];
+}
+
+@end
@@ -427,6 +427,191 @@
     [self waitForExpectationsWithTimeout:100 handler:nil];
 }
 
+- (void)testPrevalidateFailures {
+    XCTestExpectation *exp = [self expectationWithDescription:@"Failure: locally determined"];
+
+    // Get the purchase prices for our test class, which also makes the local state fresh.
+    [psiCash refreshState:@[@TEST_DEBIT_TRANSACTION_CLASS] withCompletion:^(PsiCashStatus status,
+                                                                           NSError * _Nullable error) {
+        XCTAssertNil(error);
+        XCTAssertEqual(status, PsiCashStatus_Success);
+        XCTAssertNotNil([[TestHelpers userInfo:self->psiCash] localStateMonotonicTime]);
+
+        [self->psiCash newExpiringPurchaseTransactionForClass:@TEST_DEBIT_TRANSACTION_CLASS
+                                            withDistinguisher:@"INVALID"
+                                            withExpectedPrice:@(TEST_INT64_MAX)
+                                         withMaxLocalStateAge:60
+                                               withCompletion:^(PsiCashStatus status,
+                                                                PsiCashPurchase*_Nullable purchase,
+                                                                BOOL locallyDetermined,
+                                                                NSError*_Nullable error)
+         {
+             XCTAssertNil(error);
+             XCTAssertEqual(status, PsiCashStatus_TransactionTypeNotFound);
+             XCTAssertTrue(locallyDetermined);
+             XCTAssertNil(purchase);
+
+             [self->psiCash newExpiringPurchaseTransactionForClass:@TEST_DEBIT_TRANSACTION_CLASS
+                                                 withDistinguisher:@TEST_INT64_MAX_DISTINGUISHER
+                                                 withExpectedPrice:@(TEST_INT64_MAX-1) // MISMATCH!
+                                              withMaxLocalStateAge:60
+                                                    withCompletion:^(PsiCashStatus status,
+                                                                     PsiCashPurchase*_Nullable purchase,
+                                                                     BOOL locallyDetermined,
+                                                                     NSError*_Nullable error)
+              {
+                  XCTAssertNil(error);
+                  XCTAssertEqual(status, PsiCashStatus_TransactionAmountMismatch);
+                  XCTAssertTrue(locallyDetermined);
+                  XCTAssertNil(purchase);
+
+                  [self->psiCash newExpiringPurchaseTransactionForClass:@TEST_DEBIT_TRANSACTION_CLASS
+                                                      withDistinguisher:@TEST_INT64_MAX_DISTINGUISHER
+                                                      withExpectedPrice:@TEST_INT64_MAX
+                                                   withMaxLocalStateAge:60
+                                                         withCompletion:^(PsiCashStatus status,
+                                                                          PsiCashPurchase*_Nullable purchase,
+                                                                          BOOL locallyDetermined,
+                                                                          NSError*_Nullable error)
+                   {
+                       XCTAssertNil(error);
+                       XCTAssertEqual(status, PsiCashStatus_InsufficientBalance);
+                       XCTAssertTrue(locallyDetermined);
+                       XCTAssertNil(purchase);
+
+                       [exp fulfill];
+                   }];
+              }];
+         }];
+    }];
+
+    [self waitForExpectationsWithTimeout:100 handler:nil];
+}
+
+- (void)testPrevalidateUnknownClass {
+    XCTestExpectation *exp = [self expectationWithDescription:@"Failure: unknown class goes to server"];
+
+    // Fresh local state, but without prices for the class we'll try to buy.
+    [psiCash refreshState:@[@TEST_DEBIT_TRANSACTION_CLASS] withCompletion:^(PsiCashStatus status,
+                                                                           NSError * _Nullable error) {
+        XCTAssertNil(error);
+        XCTAssertEqual(status, PsiCashStatus_Success);
+        XCTAssertNotNil([[TestHelpers userInfo:self->psiCash] localStateMonotonicTime]);
+
+        // The stored balance is insufficient, but that mustn't be decided
+        // locally for a class we know nothing about.
+        [self->psiCash newExpiringPurchaseTransactionForClass:@"UNKNOWN-CLASS"
+                                            withDistinguisher:@TEST_INT64_MAX_DISTINGUISHER
+                                            withExpectedPrice:@TEST_INT64_MAX
+                                         withMaxLocalStateAge:60
+                                               withCompletion:^(PsiCashStatus status,
+                                                                PsiCashPurchase*_Nullable purchase,
+                                                                BOOL locallyDetermined,
+                                                                NSError*_Nullable error)
+         {
+             XCTAssertNil(error);
+             XCTAssertEqual(status, PsiCashStatus_TransactionTypeNotFound);
+             XCTAssertFalse(locallyDetermined);
+             XCTAssertNil(purchase);
+
+             [exp fulfill];
+         }];
+    }];
+
+    [self waitForExpectationsWithTimeout:100 handler:nil];
+}
+
+- (void)testPrevalidateStale {
+    XCTestExpectation *exp = [self expectationWithDescription:@"Failure: stale local state goes to server"];
+
+    [psiCash refreshState:@[@TEST_DEBIT_TRANSACTION_CLASS] withCompletion:^(PsiCashStatus status,
+                                                                           NSError * _Nullable error) {
+        XCTAssertNil(error);
+        XCTAssertEqual(status, PsiCashStatus_Success);
+
+        // Any local state is too old for a zero max age.
+        [self->psiCash newExpiringPurchaseTransactionForClass:@TEST_DEBIT_TRANSACTION_CLASS
+                                            withDistinguisher:@TEST_INT64_MAX_DISTINGUISHER
+                                            withExpectedPrice:@TEST_INT64_MAX
+                                         withMaxLocalStateAge:0
+                                               withCompletion:^(PsiCashStatus status,
+                                                                PsiCashPurchase*_Nullable purchase,
+                                                                BOOL locallyDetermined,
+                                                                NSError*_Nullable error)
+         {
+             XCTAssertNil(error);
+             XCTAssertEqual(status, PsiCashStatus_InsufficientBalance);
+             XCTAssertFalse(locallyDetermined);
+             XCTAssertNil(purchase);
+
+             // Clearing the user info also clears the local state time.
+             [TestHelpers clearUserInfo:self->psiCash];
+             XCTAssertNil([[TestHelpers userInfo:self->psiCash] localStateMonotonicTime]);
+
+             [exp fulfill];
+         }];
+    }];
+
+    [self waitForExpectationsWithTimeout:100 handler:nil];
+}
+
+- (void)testPrevalidateExistingTransaction {
+    XCTestExpectation *exp = [self expectationWithDescription:@"Failure: locally determined existing transaction"];
+
+    // Start by ensuring we have sufficient balance
+    [TestHelpers makeRewardRequests:psiCash
+                             amount:1
+                         completion:^(BOOL success)
+     {
+         XCTAssert(success);
+
+         [self->psiCash refreshState:@[@TEST_DEBIT_TRANSACTION_CLASS] withCompletion:^(PsiCashStatus status,
+                                                                                      NSError * _Nullable error) {
+             XCTAssertNil(error);
+             XCTAssertEqual(status, PsiCashStatus_Success);
+
+             // Passes the local check and succeeds on the server.
+             [self->psiCash newExpiringPurchaseTransactionForClass:@TEST_DEBIT_TRANSACTION_CLASS
+                                                 withDistinguisher:@TEST_ONE_TRILLION_TEN_SECOND_DISTINGUISHER
+                                                 withExpectedPrice:@ONE_TRILLION
+                                              withMaxLocalStateAge:60
+                                                    withCompletion:^(PsiCashStatus status,
+                                                                     PsiCashPurchase*_Nullable successfulPurchase,
+                                                                     BOOL locallyDetermined,
+                                                                     NSError*_Nullable error)
+              {
+                  XCTAssertNil(error);
+                  XCTAssertEqual(status, PsiCashStatus_Success); // IF THIS FAILS, WAIT ONE MINUTE AND TRY AGAIN
+                  XCTAssertFalse(locallyDetermined);
+                  XCTAssertNotNil(successfulPurchase);
+
+                  // The same purchase again is rejected locally.
+                  [self->psiCash newExpiringPurchaseTransactionForClass:@TEST_DEBIT_TRANSACTION_CLASS
+                                                      withDistinguisher:@TEST_ONE_TRILLION_TEN_SECOND_DISTINGUISHER
+                                                      withExpectedPrice:@ONE_TRILLION
+                                                   withMaxLocalStateAge:60
+                                                         withCompletion:^(PsiCashStatus status,
+                                                                          PsiCashPurchase*_Nullable purchase,
+                                                                          BOOL locallyDetermined,
+                                                                          NSError*_Nullable error)
+                   {
+                       XCTAssertNil(error);
+                       XCTAssertEqual(status, PsiCashStatus_ExistingTransaction);
+                       XCTAssertTrue(locallyDetermined);
+                       XCTAssertNil(purchase);
+
+                       // Let the transaction expire before continuing.
+                       [NSThread sleepForTimeInterval:11.0];
+
+                       [exp fulfill];
+                   }];
+              }];
+         }];
+     }];
+
+    [self waitForExpectationsWithTimeout:100 handler:nil];
+}
+
 - (BOOL)containsTransactionWithID:(NSString*_Nonnull)ID
                  transactionClass:(NSString*_Nonnull)transactionClass
                        distinguisher:(NSString*_Nonnull)distinguisher
@@ -0,0 +1,370 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+//
+//  PurchaseStorage.m
+//  PsiCashLibTests
+//
+
+#import <XCTest/XCTest.h>
+#import <mach/mach.h>
+#import "TestHelpers.h"
+#import "PurchaseStore.h"
+
+
+@interface PurchaseStorageTests : XCTestCase
+
+@property PsiCash *psiCash;
+
+@end
+
+@implementation PurchaseStorageTests
+
+@synthesize psiCash;
+
+- (void)setUp {
+    [super setUp];
+    // Put setup code here. This method is called before the invocation of each test method in the class.
+
+    // These tests don't use the server.
+    psiCash = [TestHelpers newPsiCash];
+    [TestHelpers clearUserInfo:psiCash];
+}
+
+- (void)tearDown {
+    // Put teardown code here. This method is called after the invocation of each test method in the class.
+    [TestHelpers userInfo:self->psiCash].purchases = nil;
+    [super tearDown];
+}
+
++ (PsiCashPurchase*)purchaseWithID:(NSString*)ID
+                  transactionClass:(NSString*)transactionClass
+                     distinguisher:(NSString*)distinguisher
+                   expiresSinceNow:(NSTimeInterval)expiresSinceNow
+                     authorization:(NSString*)authorization
+{
+    NSDate *expiry = isnan(expiresSinceNow) ? nil : [NSDate dateWithTimeIntervalSinceNow:expiresSinceNow];
+    return [[PsiCashPurchase alloc] initWithID:ID
+                              transactionClass:transactionClass
+                                 distinguisher:distinguisher
+                              serverTimeExpiry:expiry
+                               localTimeExpiry:nil
+                                 authorization:authorization];
+}
+
++ (NSArray<NSString*>*)IDsOf:(NSArray<PsiCashPurchase*>*)purchases
+{
+    NSMutableArray<NSString*> *ids = [NSMutableArray array];
+    for (PsiCashPurchase *purchase in purchases) {
+        [ids addObject:purchase.ID];
+    }
+    return ids;
+}
+
+- (void)testStoreRoundTrip {
+    NSArray<PsiCashPurchase*> *input =
+        @[[PurchaseStorageTests purchaseWithID:@"id1" transactionClass:@"speed-boost" distinguisher:@"1hr" expiresSinceNow:60 authorization:@"auth1"],
+          [PurchaseStorageTests purchaseWithID:@"id2" transactionClass:@"speed-boost" distinguisher:@"2hr" expiresSinceNow:NAN authorization:nil],
+          [PurchaseStorageTests purchaseWithID:@"id3 ☃" transactionClass:@"other" distinguisher:@"1hr" expiresSinceNow:-60 authorization:@""]];
+
+    PurchaseStore *store = [[PurchaseStore alloc] initWithPurchases:(NSArray*)[input arrayByAddingObject:NSNull.null]];
+    XCTAssertEqual(store.count, 3);
+
+    NSArray<PsiCashPurchase*> *output = [store purchases];
+    XCTAssertEqual(output.count, input.count);
+    for (NSUInteger i = 0; i < input.count; i++) {
+        XCTAssertEqualObjects(output[i].ID, input[i].ID);
+        XCTAssertEqualObjects(output[i].transactionClass, input[i].transactionClass);
+        XCTAssertEqualObjects(output[i].distinguisher, input[i].distinguisher);
+        XCTAssert([TestHelpers is:output[i].serverTimeExpiry equalTo:input[i].serverTimeExpiry]);
+        XCTAssert([TestHelpers is:output[i].authorization equalTo:input[i].authorization]);
+        XCTAssertNil(output[i].localTimeExpiry);
+    }
+
+    // Class and distinguisher strings are shared.
+    XCTAssertEqual(output[0].transactionClass, output[1].transactionClass);
+    XCTAssertEqual(output[0].distinguisher, output[2].distinguisher);
+
+    // Each retrieval produces new objects.
+    XCTAssertNotEqual([store purchases][0], output[0]);
+
+    XCTAssertEqualObjects([store nextExpiringPurchase].ID, @"id3 ☃");
+
+    NSArray<PsiCashPurchase*> *valid = [store purchasesValidAt:[NSDate date]];
+    XCTAssertEqualObjects([PurchaseStorageTests IDsOf:valid], (@[@"id1", @"id2"]));
+
+    [store clear];
+    XCTAssertEqual(store.count, 0);
+    XCTAssertNil([store nextExpiringPurchase]);
+}
+
+- (void)testStoreUnencodableStrings {
+    // A lone surrogate (which a JSON "\ud800" escape can produce) has no UTF-8 encoding.
+    unichar loneSurrogate = 0xD800;
+    NSString *badID = [@"id" stringByAppendingString:[NSString stringWithCharacters:&loneSurrogate length:1]];
+    NSString *badAuth = [NSString stringWithCharacters:&loneSurrogate length:1];
+    XCTAssertNil([badID dataUsingEncoding:NSUTF8StringEncoding]);
+
+    PurchaseStore *store = [[PurchaseStore alloc] init];
+    [store addPurchase:[PurchaseStorageTests purchaseWithID:@"first" transactionClass:@"a" distinguisher:@"1hr" expiresSinceNow:60 authorization:badAuth]];
+    [store addPurchase:[PurchaseStorageTests purchaseWithID:badID transactionClass:@"a" distinguisher:@"1hr" expiresSinceNow:60 authorization:@"auth"]];
+    [store addPurchase:[PurchaseStorageTests purchaseWithID:@"last" transactionClass:@"a" distinguisher:@"1hr" expiresSinceNow:60 authorization:badAuth]];
+
+    // Stored losslessly.
+    NSArray<PsiCashPurchase*> *purchases = [store purchases];
+    XCTAssertEqualObjects(purchases[0].authorization, badAuth);
+    XCTAssertEqualObjects(purchases[1].ID, badID);
+    XCTAssertEqualObjects(purchases[1].authorization, @"auth");
+    XCTAssertEqualObjects(purchases[2].authorization, badAuth);
+
+    // And still after compaction.
+    XCTAssertTrue([store removePurchasesWithIDs:@[@"first"]]);
+    purchases = [store purchases];
+    XCTAssertEqualObjects([PurchaseStorageTests IDsOf:purchases], (@[badID, @"last"]));
+    XCTAssertEqualObjects(purchases[1].authorization, badAuth);
+
+    // Can be removed by ID.
+    XCTAssertTrue([store removePurchasesWithIDs:@[badID]]);
+    XCTAssertEqualObjects([PurchaseStorageTests IDsOf:[store purchases]], (@[@"last"]));
+    XCTAssertEqualObjects([store purchases][0].authorization, badAuth);
+}
+
+- (void)testStoreRemoval {
+    PurchaseStore *store = [[PurchaseStore alloc] init];
+    for (int i = 0; i < 10; i++) {
+        // id0 expired 100s ago, id1 80s ago, ... id9 expires in 80s
+        [store addPurchase:[PurchaseStorageTests purchaseWithID:[NSString stringWithFormat:@"id%d", i]
+                                               transactionClass:@"speed-boost"
+                                                  distinguisher:@"1hr"
+                                                expiresSinceNow:-100 + i*20
+                                                  authorization:(i % 2) ? @"auth" : nil]];
+    }
+    [store addPurchase:[PurchaseStorageTests purchaseWithID:@"forever" transactionClass:@"c" distinguisher:@"d" expiresSinceNow:NAN authorization:nil]];
+
+    XCTAssertFalse([store removePurchasesWithIDs:@[]]);
+    XCTAssertFalse([store removePurchasesWithIDs:@[@"nope"]]);
+    XCTAssertTrue([store removePurchasesWithIDs:@[@"id4", @"nope", @"id6"]]);
+    XCTAssertEqual(store.count, 9);
+
+    // Bad IDs are ignored rather than crashing.
+    unichar loneSurrogate = 0xD800;
+    NSArray *badIDs = @[[NSString stringWithCharacters:&loneSurrogate length:1], @1, NSNull.null];
+    XCTAssertFalse([store removePurchasesWithIDs:badIDs]);
+    XCTAssertEqual(store.count, 9);
+
+    // Remaining data is intact after compaction.
+    NSArray<PsiCashPurchase*> *purchases = [store purchases];
+    XCTAssertEqualObjects([PurchaseStorageTests IDsOf:purchases],
+                          (@[@"id0", @"id1", @"id2", @"id3", @"id5", @"id7", @"id8", @"id9", @"forever"]));
+    XCTAssertEqualObjects(purchases[3].authorization, @"auth");
+    XCTAssertNil(purchases[2].authorization);
+
+    // Expired are id0 (-100), id1 (-80), id2 (-60), id3 (-40), id5 (-0 = just now).
+    NSDate *now = [NSDate dateWithTimeIntervalSinceNow:1];
+
+    // Checking what would be evicted doesn't remove anything.
+    XCTAssertEqualObjects([PurchaseStorageTests IDsOf:[store purchasesRetainedAt:now gracePeriod:70 maxExpired:2]],
+                          (@[@"id3", @"id5", @"id7", @"id8", @"id9", @"forever"]));
+    XCTAssertEqualObjects([store nextExpiringPurchaseRetainedAt:now gracePeriod:70 maxExpired:2].ID, @"id3");
+    XCTAssertEqualObjects([store nextExpiringPurchase].ID, @"id0");
+    XCTAssertEqual(store.count, 9);
+
+    // Evict those expired more than 70s ago.
+    NSArray<PsiCashPurchase*> *removed = [store removeExpiredPurchasesAt:now gracePeriod:70 maxExpired:NSUIntegerMax];
+    XCTAssertEqualObjects([PurchaseStorageTests IDsOf:removed], (@[@"id0", @"id1"]));
+
+    // Keep only the latest-expired two.
+    removed = [store removeExpiredPurchasesAt:now gracePeriod:DBL_MAX maxExpired:2];
+    XCTAssertEqualObjects([PurchaseStorageTests IDsOf:removed], (@[@"id2"]));
+    XCTAssertEqual(store.count, 6);
+
+    // Remove all expired.
+    removed = [store removeExpiredPurchasesAt:now gracePeriod:0 maxExpired:0];
+    XCTAssertEqualObjects([PurchaseStorageTests IDsOf:removed], (@[@"id3", @"id5"]));
+    XCTAssertEqualObjects([PurchaseStorageTests IDsOf:[store purchases]], (@[@"id7", @"id8", @"id9", @"forever"]));
+
+    removed = [store removeExpiredPurchasesAt:now gracePeriod:0 maxExpired:0];
+    XCTAssertEqual(removed.count, 0);
+}
+
+- (void)testArchiveCompatibility {
+    NSArray<PsiCashPurchase*> *input =
+        @[[PurchaseStorageTests purchaseWithID:@"id1" transactionClass:@"speed-boost" distinguisher:@"1hr" expiresSinceNow:60 authorization:@"auth1"],
+          [PurchaseStorageTests purchaseWithID:@"id2" transactionClass:@"speed-boost" distinguisher:@"2hr" expiresSinceNow:NAN authorization:nil]];
+
+    [TestHelpers userInfo:self->psiCash].purchases = input;
+
+    // The stored value is still an archived array of PsiCashPurchase.
+    NSData *data = [[NSUserDefaults standardUserDefaults] objectForKey:@"Psiphon-PsiCash-UserInfo-Purchases"];
+    NSArray *unarchived = [NSKeyedUnarchiver unarchiveObjectWithData:data];
+    XCTAssertEqual(unarchived.count, 2);
+    XCTAssert([unarchived[0] isKindOfClass:PsiCashPurchase.class]);
+    XCTAssertEqualObjects(((PsiCashPurchase*)unarchived[1]).ID, @"id2");
+
+    // And is loaded by a new instance.
+    UserInfo *loaded = [[UserInfo alloc] init];
+    XCTAssertEqual(loaded.purchasesCount, 2);
+    XCTAssertEqualObjects([PurchaseStorageTests IDsOf:loaded.purchases], (@[@"id1", @"id2"]));
+    XCTAssertEqualObjects(loaded.purchases[0].authorization, @"auth1");
+}
+
+- (void)testRetentionPolicy {
+    [TestHelpers setServerTimeDiff:self->psiCash to:0.0];
+
+    [TestHelpers userInfo:self->psiCash].purchases =
+        @[[PurchaseStorageTests purchaseWithID:@"old" transactionClass:@"a" distinguisher:@"1hr" expiresSinceNow:-120 authorization:nil],
+          [PurchaseStorageTests purchaseWithID:@"recent1" transactionClass:@"b" distinguisher:@"1hr" expiresSinceNow:-30 authorization:nil],
+          [PurchaseStorageTests purchaseWithID:@"recent2" transactionClass:@"c" distinguisher:@"1hr" expiresSinceNow:-20 authorization:nil],
+          [PurchaseStorageTests purchaseWithID:@"recent3" transactionClass:@"d" distinguisher:@"1hr" expiresSinceNow:-10 authorization:nil],
+          [PurchaseStorageTests purchaseWithID:@"valid" transactionClass:@"e" distinguisher:@"1hr" expiresSinceNow:3600 authorization:nil],
+          [PurchaseStorageTests purchaseWithID:@"forever" transactionClass:@"f" distinguisher:@"1hr" expiresSinceNow:NAN authorization:nil]];
+
+    // By default nothing is evicted.
+    XCTAssertEqual(self->psiCash.purchases.count, 6);
+    XCTAssertEqualObjects([PurchaseStorageTests IDsOf:self->psiCash.validPurchases], (@[@"valid", @"forever"]));
+    XCTAssertEqualObjects(self->psiCash.nextExpiringPurchase.ID, @"old");
+    XCTAssertNotNil(self->psiCash.nextExpiringPurchase.localTimeExpiry);
+
+    [self->psiCash setExpiredPurchaseRetentionGracePeriod:60 maxExpiredPurchases:2];
+
+    // "old" is past the grace period; "recent1" is over the count.
+    XCTAssertEqualObjects([PurchaseStorageTests IDsOf:self->psiCash.purchases],
+                          (@[@"recent2", @"recent3", @"valid", @"forever"]));
+    XCTAssertEqualObjects(self->psiCash.nextExpiringPurchase.ID, @"recent2");
+
+    // The eviction was persisted.
+    XCTAssertEqual([[UserInfo alloc] init].purchasesCount, 4);
+
+    // The retained expired purchases are still reported by expirePurchases.
+    NSArray<PsiCashPurchase*> *expired = [self->psiCash expirePurchases];
+    XCTAssertEqualObjects([PurchaseStorageTests IDsOf:expired], (@[@"recent2", @"recent3"]));
+    XCTAssertNotNil(expired[0].localTimeExpiry);
+    XCTAssertNil([self->psiCash expirePurchases]);
+
+    // A purchase that is due for eviction, but was stored without going through
+    // a PsiCash write path, is left out by the accessors, which don't write.
+    [[TestHelpers userInfo:self->psiCash] addPurchase:[PurchaseStorageTests purchaseWithID:@"old2" transactionClass:@"a" distinguisher:@"1hr" expiresSinceNow:-120 authorization:nil]];
+
+    __block int defaultsChanges = 0;
+    id observer = [[NSNotificationCenter defaultCenter] addObserverForName:NSUserDefaultsDidChangeNotification
+                                                                    object:nil
+                                                                     queue:nil
+                                                                usingBlock:^(NSNotification *note) {
+                                                                    defaultsChanges += 1;
+                                                                }];
+    XCTAssertEqualObjects([PurchaseStorageTests IDsOf:self->psiCash.purchases], (@[@"valid", @"forever"]));
+    XCTAssertEqualObjects([PurchaseStorageTests IDsOf:self->psiCash.validPurchases], (@[@"valid", @"forever"]));
+    XCTAssertEqualObjects(self->psiCash.nextExpiringPurchase.ID, @"valid");
+    XCTAssertNotNil([self->psiCash getDiagnosticInfo]);
+    [[NSNotificationCenter defaultCenter] removeObserver:observer];
+    XCTAssertEqual(defaultsChanges, 0);
+    XCTAssertEqual([TestHelpers userInfo:self->psiCash].purchasesCount, 3);
+
+    // Setting the policy evicts it.
+    [self->psiCash setExpiredPurchaseRetentionGracePeriod:60 maxExpiredPurchases:2];
+    XCTAssertEqual([TestHelpers userInfo:self->psiCash].purchasesCount, 2);
+    XCTAssertEqual([[UserInfo alloc] init].purchasesCount, 2);
+
+    // Removing the policy.
+    [self->psiCash setExpiredPurchaseRetentionGracePeriod:DBL_MAX maxExpiredPurchases:NSUIntegerMax];
+    [[TestHelpers userInfo:self->psiCash] addPurchase:[PurchaseStorageTests purchaseWithID:@"old3" transactionClass:@"a" distinguisher:@"1hr" expiresSinceNow:-120 authorization:nil]];
+    XCTAssertEqual(self->psiCash.purchases.count, 3);
+}
+
+#pragma mark - Memory footprint
+
++ (uint64_t)physFootprint
+{
+    task_vm_info_data_t info;
+    mach_msg_type_number_t count = TASK_VM_INFO_COUNT;
+    if (task_info(mach_task_self(), TASK_VM_INFO, (task_info_t)&info, &count) != KERN_SUCCESS) {
+        return 0;
+    }
+    return info.phys_footprint;
+}
+
+//! Purchases like those loaded from storage: every string is a distinct object.
++ (NSArray<PsiCashPurchase*>*)makeRealisticPurchases:(NSUInteger)count
+{
+    NSArray<NSString*> *classes = @[@"speed-boost", @"premium-content"];
+    NSArray<NSString*> *distinguishers = @[@"1hr", @"24hr", @"7day"];
+
+    NSMutableArray<PsiCashPurchase*> *purchases = [NSMutableArray arrayWithCapacity:count];
+    for (NSUInteger i = 0; i < count; i++) {
+        @autoreleasepool {
+            NSString *authorization;
+            if (i % 2 == 0) {
+                // Roughly the size of a real signed authorization.
+                NSMutableData *authData = [NSMutableData dataWithLength:160];
+                arc4random_buf(authData.mutableBytes, authData.length);
+                authorization = [authData base64EncodedStringWithOptions:0];
+            }
+
+            PsiCashPurchase *purchase =
+                [[PsiCashPurchase alloc] initWithID:[NSUUID UUID].UUIDString
+                                   transactionClass:[NSMutableString stringWithString:classes[i % classes.count]].copy
+                                      distinguisher:[NSMutableString stringWithString:distinguishers[i % distinguishers.count]].copy
+                                   serverTimeExpiry:[NSDate dateWithTimeIntervalSinceNow:(double)i + 0.123]
+                                    localTimeExpiry:nil
+                                      authorization:authorization];
+            [purchases addObject:purchase];
+        }
+    }
+    return purchases;
+}
+
+- (void)testMemoryFootprint {
+    for (NSNumber *n in @[@1000, @10000, @100000]) {
+        NSUInteger count = n.unsignedIntegerValue;
+        uint64_t before, afterObjects, afterStore;
+
+        @autoreleasepool {
+            before = [PurchaseStorageTests physFootprint];
+
+            NSArray<PsiCashPurchase*> *objects;
+            @autoreleasepool {
+                objects = [PurchaseStorageTests makeRealisticPurchases:count];
+            }
+            afterObjects = [PurchaseStorageTests physFootprint];
+
+            PurchaseStore *store;
+            @autoreleasepool {
+                store = [[PurchaseStore alloc] initWithPurchases:objects];
+            }
+            afterStore = [PurchaseStorageTests physFootprint];
+
+            XCTAssertEqual(store.count, count);
+        }
+
+        int64_t objectsBytes = (int64_t)(afterObjects - before);
+        int64_t storeBytes = (int64_t)(afterStore - afterObjects);
+
+        NSLog(@"Purchases: %lu; objects: %lld bytes (%.0f/purchase); store: %lld bytes (%.0f/purchase)",
+              (unsigned long)count,
+              objectsBytes, (double)objectsBytes / count,
+              storeBytes, (double)storeBytes / count);
+
+        // Small counts are lost in the noise of page-granular measurement.
+        if (count >= 10000) {
+            XCTAssertLessThan(storeBytes, objectsBytes);
+        }
+    }
+}
+
+@end
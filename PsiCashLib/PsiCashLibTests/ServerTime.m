@@ -0,0 +1,347 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+//
+//  ServerTime.m
+//  PsiCashLibTests
+//
+
+#import <XCTest/XCTest.h>
+#import "TestHelpers.h"
+#import "LocalTestServer.h"
+#import "ServerTimeEstimator.h"
+#import "RequestBuilder.h"
+
+// Expose some private methods to help with testing
+@interface PsiCash (Testing)
+- (RequestBuilder*_Nonnull)createRequestBuilderFor:(NSString*_Nonnull)path
+                                        withMethod:(NSString*_Nonnull)method
+                                    withQueryItems:(NSArray*_Nullable)queryItems
+                                 includeAuthTokens:(BOOL)includeAuthTokens;
+
+- (void)doRequestWithRetry:(RequestBuilder*_Nonnull)requestBuilder
+                  useCache:(BOOL)useCache
+         completionHandler:(void (^_Nonnull)(NSData*_Nullable data,
+                                             NSHTTPURLResponse*_Nullable response,
+                                             NSError*_Nullable error))completionHandler;
+@end
+
+
+@interface ServerTimeTests : XCTestCase
+
+@property PsiCash *psiCash;
+
+@end
+
+
+@implementation ServerTimeTests
+
+@synthesize psiCash;
+
+- (void)setUp {
+    [super setUp];
+    // Put setup code here. This method is called before the invocation of each test method in the class.
+
+    // These tests don't use the real server.
+    [LocalTestServer start];
+
+    psiCash = [TestHelpers newPsiCash];
+    [TestHelpers clearUserInfo:psiCash];
+}
+
+- (void)tearDown {
+    // Put teardown code here. This method is called after the invocation of each test method in the class.
+    [LocalTestServer stop];
+    [super tearDown];
+}
+
+//! Makes count requests to the local server, one after the other.
+- (void)makeRequests:(int)count completion:(void (^_Nonnull)(void))completionHandler
+{
+    if (count <= 0) {
+        completionHandler();
+        return;
+    }
+
+    RequestBuilder *requestBuilder = [self->psiCash createRequestBuilderFor:@"/refresh-state"
+                                                                 withMethod:@"GET"
+                                                             withQueryItems:nil
+                                                          includeAuthTokens:NO];
+
+    [self->psiCash doRequestWithRetry:requestBuilder
+                             useCache:NO
+                    completionHandler:^(NSData *data, NSHTTPURLResponse *response, NSError *error)
+     {
+         XCTAssertNil(error);
+         XCTAssertEqual(response.statusCode, 200);
+
+         // Recurse
+         [self makeRequests:count-1 completion:completionHandler];
+     }];
+}
+
+- (void)testEstimatorSingleSample {
+    ServerTimeEstimator *estimator = [[ServerTimeEstimator alloc] initWithWindowSize:8];
+    NSTimeInterval diff, uncertainty;
+
+    XCTAssertFalse([estimator serverTimeDiff:&diff uncertainty:&uncertainty]);
+
+    // Server is 100s ahead. Its Date is truncated to the second.
+    NSDate *requestTime = [NSDate dateWithTimeIntervalSinceReferenceDate:1000.0];
+    NSDate *responseTime = [NSDate dateWithTimeIntervalSinceReferenceDate:1000.2];
+    NSDate *serverDate = [NSDate dateWithTimeIntervalSinceReferenceDate:1100.0];
+
+    [estimator addSampleWithServerDate:serverDate requestTime:requestTime responseTime:responseTime];
+
+    XCTAssertTrue([estimator serverTimeDiff:&diff uncertainty:&uncertainty]);
+    // The diff is within [1100-1000.2, 1101-1000] = [99.8, 101.0]
+    XCTAssertEqualWithAccuracy(diff, 100.4, 0.0001);
+    XCTAssertEqualWithAccuracy(uncertainty, 0.6, 0.0001);
+
+    // A response received before it was sent is ignored.
+    [estimator addSampleWithServerDate:serverDate requestTime:responseTime responseTime:requestTime];
+    XCTAssertTrue([estimator serverTimeDiff:&diff uncertainty:&uncertainty]);
+    XCTAssertEqualWithAccuracy(diff, 100.4, 0.0001);
+
+    [estimator reset];
+    XCTAssertFalse([estimator serverTimeDiff:&diff uncertainty:&uncertainty]);
+}
+
+- (void)testEstimatorConverges {
+    ServerTimeEstimator *estimator = [[ServerTimeEstimator alloc] initWithWindowSize:8];
+    NSTimeInterval diff, uncertainty, prevUncertainty = DBL_MAX;
+    NSTimeInterval const trueDiff = 100.25;
+
+    // Requests sent at varying fractions of a second narrow the interval.
+    for (int i = 0; i < 8; i++) {
+        NSTimeInterval sent = 1000.0 + i*10.0 + i*0.13;
+        NSTimeInterval received = sent + 0.1;
+        // The server handled the request halfway through, and truncates its time.
+        NSTimeInterval serverTime = floor(sent + 0.05 + trueDiff);
+
+        [estimator addSampleWithServerDate:[NSDate dateWithTimeIntervalSinceReferenceDate:serverTime]
+                               requestTime:[NSDate dateWithTimeIntervalSinceReferenceDate:sent]
+                              responseTime:[NSDate dateWithTimeIntervalSinceReferenceDate:received]
+                     monotonicResponseTime:received];
+
+        XCTAssertTrue([estimator serverTimeDiff:&diff uncertainty:&uncertainty]);
+        XCTAssertLessThanOrEqual(uncertainty, prevUncertainty);
+        XCTAssertLessThanOrEqual(fabs(diff - trueDiff), uncertainty);
+        prevUncertainty = uncertainty;
+    }
+
+    XCTAssertLessThan(uncertainty, 0.2);
+}
+
+- (void)testEstimatorRejectsOutliers {
+    ServerTimeEstimator *estimator = [[ServerTimeEstimator alloc] initWithWindowSize:8];
+    NSTimeInterval diff, uncertainty;
+
+    for (int i = 0; i < 8; i++) {
+        NSTimeInterval sent = 1000.0 + i*10.0;
+        NSTimeInterval received = sent + 0.2;
+        NSTimeInterval serverTime = floor(sent + 0.1 + 100.0);
+
+        if (i == 3) {
+            // A wild sample, such as from a misbehaving server or proxy.
+            serverTime += 50.0;
+        }
+        if (i == 5) {
+            // A very slow response. Its bounds are loose but still correct.
+            received = sent + 8.0;
+        }
+
+        [estimator addSampleWithServerDate:[NSDate dateWithTimeIntervalSinceReferenceDate:serverTime]
+                               requestTime:[NSDate dateWithTimeIntervalSinceReferenceDate:sent]
+                              responseTime:[NSDate dateWithTimeIntervalSinceReferenceDate:received]
+                     monotonicResponseTime:received];
+    }
+
+    XCTAssertTrue([estimator serverTimeDiff:&diff uncertainty:&uncertainty]);
+    XCTAssertEqualWithAccuracy(diff, 100.4, 0.0001);
+    XCTAssertEqualWithAccuracy(uncertainty, 0.6, 0.0001);
+}
+
+- (void)testEstimatorFollowsClockJump {
+    ServerTimeEstimator *estimator = [[ServerTimeEstimator alloc] initWithWindowSize:8];
+    NSTimeInterval diff, uncertainty;
+
+    // The local clock and the monotonic clock agree.
+    for (int i = 0; i < 8; i++) {
+        NSTimeInterval sent = 1000.0 + i*10.0;
+        [estimator addSampleWithServerDate:[NSDate dateWithTimeIntervalSinceReferenceDate:floor(sent + 0.1 + 100.0)]
+                               requestTime:[NSDate dateWithTimeIntervalSinceReferenceDate:sent]
+                              responseTime:[NSDate dateWithTimeIntervalSinceReferenceDate:sent + 0.2]
+                     monotonicResponseTime:sent + 0.2];
+    }
+
+    XCTAssertTrue([estimator serverTimeDiff:&diff uncertainty:&uncertainty]);
+    XCTAssertEqualWithAccuracy(diff, 100.4, 0.0001);
+
+    // A wild sample is rejected, rather than taken as a clock change.
+    [estimator addSampleWithServerDate:[NSDate dateWithTimeIntervalSinceReferenceDate:floor(1080.1 + 150.0)]
+                           requestTime:[NSDate dateWithTimeIntervalSinceReferenceDate:1080.0]
+                          responseTime:[NSDate dateWithTimeIntervalSinceReferenceDate:1080.2]
+                 monotonicResponseTime:1080.2];
+
+    XCTAssertTrue([estimator serverTimeDiff:&diff uncertainty:&uncertainty]);
+    XCTAssertEqualWithAccuracy(diff, 100.4, 0.0001);
+
+    // Then the local clock is set back by 100s, while the monotonic clock (and
+    // the server's) carry on. The very next sample is used, even though all of
+    // the older samples disagree with it.
+    NSTimeInterval monotonicSent = 1090.0;
+    NSTimeInterval sent = monotonicSent - 100.0;
+    [estimator addSampleWithServerDate:[NSDate dateWithTimeIntervalSinceReferenceDate:floor(monotonicSent + 0.1 + 100.0)]
+                           requestTime:[NSDate dateWithTimeIntervalSinceReferenceDate:sent]
+                          responseTime:[NSDate dateWithTimeIntervalSinceReferenceDate:sent + 0.2]
+                 monotonicResponseTime:monotonicSent + 0.2];
+
+    XCTAssertTrue([estimator serverTimeDiff:&diff uncertainty:&uncertainty]);
+    XCTAssertEqualWithAccuracy(diff, 200.4, 0.0001);
+    XCTAssertEqualWithAccuracy(uncertainty, 0.6, 0.0001);
+}
+
+- (void)testEstimatorNeedsAgreementToChange {
+    ServerTimeEstimator *estimator = [[ServerTimeEstimator alloc] initWithWindowSize:8];
+    NSTimeInterval diff, uncertainty;
+
+    // As at the start of a session: a single sample, within [99.8, 101.0].
+    [estimator addSampleWithServerDate:[NSDate dateWithTimeIntervalSinceReferenceDate:1100.0]
+                           requestTime:[NSDate dateWithTimeIntervalSinceReferenceDate:1000.0]
+                          responseTime:[NSDate dateWithTimeIntervalSinceReferenceDate:1000.2]
+                 monotonicResponseTime:1000.2];
+
+    // A disagreeing sample, within [101.8, 103.0], doesn't win the tie.
+    [estimator addSampleWithServerDate:[NSDate dateWithTimeIntervalSinceReferenceDate:1112.0]
+                           requestTime:[NSDate dateWithTimeIntervalSinceReferenceDate:1010.0]
+                          responseTime:[NSDate dateWithTimeIntervalSinceReferenceDate:1010.2]
+                 monotonicResponseTime:1010.2];
+
+    XCTAssertTrue([estimator serverTimeDiff:&diff uncertainty:&uncertainty]);
+    XCTAssertEqualWithAccuracy(diff, 100.4, 0.0001);
+
+    // A second sample agreeing with it does.
+    [estimator addSampleWithServerDate:[NSDate dateWithTimeIntervalSinceReferenceDate:1122.0]
+                           requestTime:[NSDate dateWithTimeIntervalSinceReferenceDate:1020.0]
+                          responseTime:[NSDate dateWithTimeIntervalSinceReferenceDate:1020.2]
+                 monotonicResponseTime:1020.2];
+
+    XCTAssertTrue([estimator serverTimeDiff:&diff uncertainty:&uncertainty]);
+    XCTAssertEqualWithAccuracy(diff, 102.4, 0.0001);
+}
+
+- (void)testDateHeaderParsing {
+    NSDate *date = [ServerTimeEstimator dateFromHTTPDateHeader:@"Sun, 06 Nov 1994 08:49:37 GMT"];
+    XCTAssertEqualObjects(date, [NSDate dateWithTimeIntervalSince1970:784111777]);
+
+    XCTAssertNil([ServerTimeEstimator dateFromHTTPDateHeader:@"not a date"]);
+}
+
+- (void)testSkewFromLocalServer {
+    XCTestExpectation *exp = [self expectationWithDescription:@"Server time diff from local server"];
+
+    NSTimeInterval const skew = -123.4;
+    [LocalTestServer setSkew:skew];
+    // Asymmetric latency, which parsing the Date alone can't account for.
+    [LocalTestServer setRequestLatency:0.05 responseLatency:0.4];
+
+    [self makeRequests:5 completion:^{
+        // Within the Date resolution plus the round trip.
+        XCTAssertEqualWithAccuracy([TestHelpers userInfo:self->psiCash].serverTimeDiff, skew, 1.0);
+
+        NSDictionary *info = [self->psiCash getDiagnosticInfo];
+        NSNumber *uncertainty = info[@"serverTimeDiffUncertainty"];
+        XCTAssert([uncertainty isKindOfClass:NSNumber.class]);
+        XCTAssertLessThanOrEqual(uncertainty.doubleValue, 1.0);
+
+        XCTAssertEqual([LocalTestServer requestCount], 5);
+
+        // A very slow response would have shifted the old Date-only diff by its latency.
+        [LocalTestServer setRequestLatency:0.05 responseLatency:3.0];
+
+        [self makeRequests:2 completion:^{
+            XCTAssertEqualWithAccuracy([TestHelpers userInfo:self->psiCash].serverTimeDiff, skew, 1.0);
+
+            [exp fulfill];
+        }];
+    }];
+
+    [self waitForExpectationsWithTimeout:100 handler:nil];
+}
+
+- (void)testServerClockChangeFromLocalServer {
+    XCTestExpectation *exp = [self expectationWithDescription:@"Server time diff follows a sustained server clock change"];
+
+    [LocalTestServer setSkew:100.0];
+
+    [self makeRequests:5 completion:^{
+        XCTAssertEqualWithAccuracy([TestHelpers userInfo:self->psiCash].serverTimeDiff, 100.0, 1.0);
+
+        // The local clock hasn't changed, so a single disagreeing Date is
+        // rejected as an outlier and not stored.
+        [LocalTestServer setSkew:200.0];
+
+        [self makeRequests:1 completion:^{
+            XCTAssertEqualWithAccuracy([TestHelpers userInfo:self->psiCash].serverTimeDiff, 100.0, 1.0);
+
+            // Once the new samples outnumber the old ones, the change is followed.
+            [self makeRequests:4 completion:^{
+                XCTAssertEqualWithAccuracy([TestHelpers userInfo:self->psiCash].serverTimeDiff, 200.0, 1.0);
+
+                [exp fulfill];
+            }];
+        }];
+    }];
+
+    [self waitForExpectationsWithTimeout:100 handler:nil];
+}
+
+- (void)testStableSkewWrites {
+    XCTestExpectation *exp = [self expectationWithDescription:@"Stable server time diff isn't rewritten"];
+
+    [LocalTestServer setSkew:3600.0];
+    [LocalTestServer setRequestLatency:0.1 responseLatency:0.1];
+
+    // Nothing but the server time diff is written by these requests.
+    __block int defaultsChanges = 0;
+    id observer = [[NSNotificationCenter defaultCenter] addObserverForName:NSUserDefaultsDidChangeNotification
+                                                                    object:nil
+                                                                     queue:nil
+                                                                usingBlock:^(NSNotification *note) {
+                                                                    defaultsChanges += 1;
+                                                                }];
+
+    [self makeRequests:10 completion:^{
+        [[NSNotificationCenter defaultCenter] removeObserver:observer];
+
+        XCTAssertEqualWithAccuracy([TestHelpers userInfo:self->psiCash].serverTimeDiff, 3600.0, 1.0);
+
+        // Previously every response was written. Now only the first and any
+        // refinements bigger than the uncertainty.
+        XCTAssertGreaterThanOrEqual(defaultsChanges, 1);
+        XCTAssertLessThanOrEqual(defaultsChanges, 3);
+
+        [exp fulfill];
+    }];
+
+    [self waitForExpectationsWithTimeout:100 handler:nil];
+}
+
+@end
@@ -27,6 +27,7 @@
 #import "UserInfo.h"
 #import "HTTPStatusCodes.h"
 #import "RequestBuilder.h"
+#import "LocalTestServer.h"
 
 
 
@@ -103,6 +104,12 @@ int requestMutatorsIndex;
         [requestBuilder addHeaders:headers];
     }
 }
+
++ (void)sessionConfigurationMutator:(NSURLSessionConfiguration*)config
+{
+    // Route requests to the local server, if it's started.
+    [LocalTestServer installInSessionConfiguration:config];
+}
 @end
 
 @implementation TestHelpers